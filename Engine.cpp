@@ -0,0 +1,3357 @@
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "include/Engine.h"
+#include "include/Interpreter.h"
+#include "include/KaleidoscopeJIT.h"
+#include "include/Library.h"
+#include "include/SourceBuffer.h"
+#include "include/SymbolTable.h"
+#include "include/TimeReport.h"
+#include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Type.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Scalar/TailRecursionElimination.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+
+using namespace llvm;
+using namespace llvm::orc;
+using zlang::Compiler;
+using zlang::SymbolID;
+using zlang::TimeReport;
+
+enum Token {
+    tok_eof = -1,
+    tok_def = -2,
+    tok_extern = -3,
+
+    tok_identifier = -4,
+    tok_number = -5,
+
+    // control
+    tok_if = -6,
+    tok_then = -7,
+    tok_else = -8,    
+    tok_for = -9,
+    tok_in = -10,
+
+    // types
+    tok_vec = -11,
+    tok_buf = -12,
+
+    // var definition
+    tok_var = -13,
+
+    // function attributes
+    tok_fast = -14,
+    tok_memo = -15,
+};
+
+// keywords are interned first, so their IDs index straight into this table.
+static const char* const Keywords[] = {
+    "def", "extern", "if", "then", "else", "for", "in", "vec", "buf", "var",
+    "fast", "memo",
+};
+static const int KeywordTokens[] = {
+    tok_def, tok_extern, tok_if, tok_then, tok_else, tok_for, tok_in, tok_vec,
+    tok_buf, tok_var, tok_fast, tok_memo,
+};
+
+// builtin functions are interned right after the keywords, in this order.
+enum Builtin { BI_Splat, BI_Extract, BI_Insert, BI_HSum, BI_Len, BI_None };
+static const char* const Builtins[] = {
+    "splat", "extract", "insert", "hsum", "len",
+};
+static const unsigned BuiltinArity[] = {1, 2, 3, 1, 1};
+
+static Builtin getBuiltin(SymbolID ID) {
+    SymbolID First = array_lengthof(Keywords);
+    if (ID < First || ID >= First + array_lengthof(Builtins)) return BI_None;
+    return Builtin(ID - First);
+}
+
+// C math functions an extern may name that only compute their result, so
+// memo functions may call them. Any other extern is assumed to have effects.
+static bool isPureLibraryFunction(StringRef Name) {
+    static const char* const Names[] = {
+        "sin", "cos", "tan", "asin", "acos", "atan", "atan2", "sinh", "cosh",
+        "tanh", "exp", "exp2", "expm1", "log", "log2", "log10", "log1p", "pow",
+        "sqrt", "cbrt", "hypot", "fabs", "floor", "ceil", "trunc", "round",
+        "fmod", "fmin", "fmax", "copysign",
+    };
+    return is_contained(Names, Name);
+}
+
+// precedence of each binary operator, indexed by its character; 0 means the
+// character is not a binary operator.
+struct BinopTable {
+    int Prec[256];
+};
+
+static constexpr BinopTable DefaultBinops() {
+    BinopTable T{};
+    T.Prec['<'] = 10;
+    T.Prec['>'] = 10;
+    T.Prec['+'] = 20;
+    T.Prec['-'] = 20;
+    T.Prec['*'] = 40;
+    T.Prec['/'] = 40;
+    return T;
+}
+
+// every value is a double, a vector of --vector-width doubles, or a buffer
+// of doubles passed in as a pointer and a length.
+enum class ValType : uint8_t { Num, Vec, Buf };
+
+class ExprAST;
+class PrototypeAST;
+class FunctionAST;
+
+/* Everything one Engine owns: the lexer and parser, the module being built and
+ * the JIT and interpreter that run it. Parsing and the driver are members, and
+ * codegen and lowering take the Compiler they work for, so engines never share
+ * any state. */
+class zlang::Compiler {
+public:
+    EngineOptions Opts;
+
+    /// lexer and parser
+    std::unique_ptr<SourceBuffer> Source;
+    SymbolTable Symbols;
+    SymbolID IdentifierID;
+    double NumVal;
+    int CurTok;
+    // line the lexer is on, and the one CurTok is on.
+    unsigned CurLine = 1;
+    unsigned TokLine = 1;
+    // where the item being handled starts, and the same once it has been
+    // parsed so that later errors point at the item (0 while parsing).
+    unsigned ItemStart = 0;
+    unsigned ItemLine = 0;
+    // starts from the defaults; InstallBinop() adds to it at runtime.
+    BinopTable BinopPrecedence = DefaultBinops();
+
+    /* AST nodes for one top-level item are bump-allocated in ASTArena and
+     * released together once the item has been handled. Destructors are never
+     * run, so nodes must not own heap memory; child lists are arrays in the
+     * same arena. */
+    BumpPtrAllocator ASTArena;
+
+    // reported by LogError() during the current run().
+    std::vector<Diagnostic> Diagnostics;
+
+    /// code generation
+    std::unique_ptr<LLVMContext> TheContext;
+    std::unique_ptr<IRBuilder<>> Builder;
+    std::unique_ptr<Module>      TheModule;
+    // stack slot of each variable in scope; mem2reg turns them back into SSA.
+    SymbolMap<AllocaInst*> NameValues;
+
+    // phase timings for the time report; null unless Opts.TimeReport. Declared
+    // ahead of everything that records into it.
+    std::unique_ptr<TimeReport> Timers;
+    // reports the passes run by TheFPM and writeObject() to Timers.
+    PassInstrumentationCallbacks ThePIC;
+
+    // per-function cleanup run as each function is codegen'd.
+    FunctionPassManager TheFPM;
+    LoopAnalysisManager TheLAM;
+    FunctionAnalysisManager TheFAM;
+    CGSCCAnalysisManager TheCGAM;
+    ModuleAnalysisManager TheMAM;
+
+    // --emit-ir and --emit-asm output, written from whichever thread a module
+    // is compiled on. Only the functions in DumpFunctions, if it is not empty.
+    std::unique_ptr<raw_fd_ostream> IROut;
+    std::unique_ptr<raw_fd_ostream> AsmOut;
+    StringSet<> DumpFunctions;
+    std::mutex DumpMutex;
+
+    // imported libraries, which the JIT parses modules from as it needs them.
+    std::vector<std::unique_ptr<Library>> Libraries;
+
+    // errors the JIT session had no caller to return to, such as failing to
+    // materialize a symbol, from whichever thread they came up on.
+    std::mutex JITErrorsMutex;
+    std::vector<std::string> JITErrors;
+
+    std::unique_ptr<KaleidoscopeJIT> TheJIT;
+    // target for AheadOfTime; TheJIT is null in that mode.
+    std::unique_ptr<TargetMachine> TheTargetMachine;
+    // hold the most recent prototype for each function
+    SymbolMap<PrototypeAST*> FunctionProtos;
+    // prototypes in FunctionProtos live here for the rest of the session
+    BumpPtrAllocator ProtoArena;
+
+    // bitcode for small functions already handed to the JIT, by name. Each
+    // holds the function, available_externally, and declarations of what it
+    // calls.
+    StringMap<std::string> InlineBodies;
+
+    // number of definitions codegen'd into TheModule but not yet given to the JIT
+    unsigned PendingDefs = 0;
+
+    /// bytecode
+    std::unique_ptr<bc::Interpreter> TheInterp;
+    // interpreter function index + 1 of each defined or extern'd name
+    SymbolMap<unsigned> BCFunctions;
+    // each definition lowered since the last flush, with the BCFunctions
+    // entry it replaced, to put back if the JIT rejects the module.
+    std::vector<std::pair<SymbolID, unsigned>> PendingLowered;
+
+    /// top-level expressions
+    // compiled top-level expressions, keyed by ExprAST::appendKey() of the
+    // body. They stay resident in the JIT until evicted in insertion order.
+    struct CachedExpr {
+        double (*FP)();
+        ResourceTrackerSP RT;
+    };
+    StringMap<CachedExpr> ExprCache;
+    std::deque<StringRef> ExprCacheOrder;
+    unsigned ExprCounter = 0;
+
+    // address of the loop made by codegenBatchWrapper() for each function
+    StringMap<uint64_t> BatchWrappers;
+
+    /// memoization
+    // externs, and definitions calling them, that may have side effects and
+    // so cannot be memoized.
+    SymbolMap<bool> Impure;
+    // what the body being codegen'd calls, other than builtins.
+    bool CallsImpure = false;
+    bool CallsDefinition = false;
+    // whether --memoize applies to the definition being codegen'd.
+    bool Memoizing = false;
+
+    /// AST simplification
+    // type of each variable in scope while simplifying.
+    SymbolMap<ValType> SimplifyTypes;
+    // set when an if arm is dropped, which codegen has then not checked.
+    bool DroppedArm = false;
+    // copies of the definitions that calls with constant arguments may be
+    // evaluated through, kept in FoldArena for the rest of the session.
+    SymbolMap<FunctionAST*> FoldBodies;
+    BumpPtrAllocator FoldArena;
+    // every call evaluated so far, by appendKey() of the call, and whether
+    // it could be.
+    StringMap<std::pair<bool, double>> FoldedCalls;
+    // variables bound while evaluating, those of the innermost call from
+    // EvalFrame on, and the loop iterations and calls still allowed.
+    std::vector<std::pair<SymbolID, double>> EvalVars;
+    size_t EvalFrame = 0;
+    unsigned EvalSteps = 0;
+    unsigned EvalDepth = 0;
+
+    /// profile-guided reoptimization
+    // a definition compiled with counters by InstrumentFunction().
+    struct ProfiledFunction {
+        Compiler* CG;
+        std::string Name;
+        // the function, markers and all, before any passes ran on it.
+        std::string Bitcode;
+        // [0] counts calls and loop iterations; newCounter() hands out the rest.
+        std::unique_ptr<uint64_t[]> Counters;
+        std::atomic<bool> Scheduled{false};
+    };
+    // whether the definition being codegen'd gets counters, and how many
+    // it has so far.
+    bool Profiling = false;
+    unsigned NumCounters = 0;
+    std::deque<ProfiledFunction> ProfiledFunctions;
+    // the same by name, for Reoptimize() to find callees from its thread.
+    StringMap<ProfiledFunction*> ProfiledByName;
+    std::mutex ProfiledMutex;
+    // profiled definitions in TheModule, which get a stub when flushed.
+    std::vector<std::string> PendingProfiled;
+    // runs Reoptimize(). Declared last, so that it finishes before anything
+    // it uses goes away.
+    std::unique_ptr<ThreadPool> ReoptThread;
+
+    explicit Compiler(const EngineOptions& Opts) : Opts(Opts) {
+        if (!Opts.TimeReport) return;
+        Timers = std::make_unique<TimeReport>();
+        Timers->registerCallbacks(ThePIC);
+    }
+
+    Error initialize();
+    // handle every item in S, then hand back what was reported.
+    Error run(std::unique_ptr<SourceBuffer> S);
+    Expected<uint64_t> lookupFunction(StringRef Name, StringRef Signature);
+    Expected<uint64_t> lookupBatch(StringRef Name, unsigned NumParams);
+    Function* codegenBatchWrapper(SymbolID Name);
+    Function* codegenMemoWrapper(Function& Compute);
+    void RetainFoldBody(const FunctionAST& FnAST);
+    bool foldCall(const ExprAST& Call, const PrototypeAST& Callee, ArrayRef<double> Args, double& V);
+    bool evalCall(SymbolID Callee, ArrayRef<double> Args, double& V);
+    double* lookupEvalVar(SymbolID Name);
+    Error writeObject(StringRef Path);
+    Error importLibrary(StringRef Path);
+    Error writeLibrary(StringRef Path);
+
+    template <typename T, typename... ArgTs>
+    T* make(ArgTs&&... Args) {
+        return new (ASTArena.Allocate<T>()) T(std::forward<ArgTs>(Args)...);
+    }
+
+    void InstallKeywords();
+    int gettoken();
+    int getNextToken();
+
+    ExprAST* LogError(const char* Str);
+    PrototypeAST* LogErrorP(const char* Str);
+    llvm::Value* LogErrorV(const char* Str);
+    // report Err, if it is an error, and return whether it was.
+    bool failed(Error Err);
+    // report the pending JITErrors as diagnostics of the current item.
+    void ReportJITErrors();
+    // add the pending JITErrors to Err, for callers outside an item.
+    Error withJITErrors(Error Err);
+
+    ExprAST* ParseNumberExpr();
+    ExprAST* ParseParenExpr();
+    ExprAST* ParseIdentifierExpr();
+    ExprAST* ParseIfExpr();
+    ExprAST* ParseForExpr();
+    ExprAST* ParseVarExpr();
+    ExprAST* ParsePrimary();
+    int GetTokPrecedence();
+    void InstallBinop(unsigned char Op, int Prec);
+    ExprAST* ParseExpression();
+    ExprAST* ParseBinOpRHS(int ExprPrec, ExprAST* LHS);
+    bool ParseType(ValType& T);
+    PrototypeAST* ParsePrototype();
+    FunctionAST* ParseDefinition();
+    PrototypeAST* ParseExtern();
+    FunctionAST* ParseTopLevelExpr();
+
+    Type* getLLVMType(ValType T);
+    llvm::Value* coerce(llvm::Value* V, Type* To);
+    std::string SnapshotFunction(Function& F, GlobalValue::LinkageTypes Linkage);
+    void SaveInlineBody(Function& F);
+    Function* ImportInlineBody(StringRef Name);
+    Function* getFunction(SymbolID Name);
+    llvm::Value* codegenBuiltin(Builtin BI, ArrayRef<ExprAST*> Args);
+
+    unsigned newCounter() { return NumCounters++; }
+    void emitCount(unsigned Counter);
+    void profileBranch(BranchInst* Br, StringRef Kind, unsigned Taken, unsigned NotTaken);
+    void InstrumentFunction(Function& F);
+    void Reoptimize(ProfiledFunction& P);
+
+    bc::Function& AddBytecodeFunction(const PrototypeAST& Proto);
+    void LowerDefinition(FunctionAST& FnAST);
+
+    void InitializeModuleAndPassManager();
+    void InitializePassManager();
+    Error InitializeTargetMachine();
+    Error InitializeDumps();
+    void dumpModule(Module& M, TargetMachine& TM);
+    // whether F is written to the dumps when its module is compiled.
+    bool isDumped(const Function& F) const;
+    Error FlushPendingDefinitions();
+    void HandleDefinition();
+    void HandleExtern();
+    void EvictCachedExpr();
+    void HandleTopLevelExpression();
+    void MainLoop();
+};
+
+void Compiler::InstallKeywords() {
+    for (const char* KW : Keywords) {
+        Symbols.intern(KW);
+    }
+    for (const char* BI : Builtins) {
+        Symbols.intern(BI);
+    }
+}
+
+int Compiler::gettoken() {
+    int LastChar = Source->peek();
+
+    // skip whitespaces; tokens never span lines, so this is where lines end.
+    while (isspace(LastChar)) {
+        if (LastChar == '\n') ++CurLine;
+        Source->advance();
+        LastChar = Source->peek();
+    }
+    TokLine = CurLine;
+
+    if (isalpha(LastChar)) {
+        Source->beginToken();
+        do {
+            Source->advance();
+        } while (isalnum(Source->peek()));
+        IdentifierID = Symbols.intern(Source->takeToken());
+
+        if (IdentifierID < array_lengthof(KeywordTokens)) {
+            return KeywordTokens[IdentifierID];
+        }
+
+        return tok_identifier;
+    }
+
+    if (isdigit(LastChar)|| LastChar == '.') {
+        Source->beginToken();
+        do {
+            Source->advance();
+            LastChar = Source->peek();
+        } while(isdigit(LastChar) || LastChar == '.');
+
+        SmallString<32> NumStr(Source->takeToken());
+        NumVal = strtod(NumStr.c_str(), 0);
+        return tok_number;
+    }
+
+    // comments
+    if (LastChar == '#') {
+        do {
+            Source->advance();
+            LastChar = Source->peek();
+        } while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
+        
+        if (LastChar != EOF) {
+            // recursively call myself
+            return gettoken();
+        }
+    }
+
+    if (LastChar == EOF) {
+        return tok_eof;
+    }
+
+    // such as '+', just return the ascii value.
+    Source->advance();
+    return LastChar;
+
+}
+
+template <typename T>
+static ArrayRef<T> copyArray(BumpPtrAllocator& A, ArrayRef<T> Elts) {
+    T* Mem = A.Allocate<T>(Elts.size());
+    std::uninitialized_copy(Elts.begin(), Elts.end(), Mem);
+    return makeArrayRef(Mem, Elts.size());
+}
+
+template <typename T, typename... ArgTs>
+static T* makeIn(BumpPtrAllocator& A, ArgTs&&... Args) {
+    return new (A.Allocate<T>()) T(std::forward<ArgTs>(Args)...);
+}
+
+// append raw bytes of V to an expression key.
+template <typename T>
+static void appendKeyBytes(SmallVectorImpl<char>& Key, const T& V) {
+    const char* P = reinterpret_cast<const char*>(&V);
+    Key.append(P, P + sizeof(T));
+}
+
+// Base class for all expression nodes.
+class ExprAST {
+public:
+    virtual ~ExprAST() = default;
+    virtual Value* codegen(Compiler& CG) = 0;
+    // emit bytecode computing this expression and return the register that
+    // holds the result, or -1 if the interpreter cannot run it. Only called
+    // on code that has already been through codegen(), so that reports errors.
+    virtual int lower(Compiler& CG, zlang::bc::Builder& B) = 0;
+    // append a byte encoding of this subtree; two expressions have the same
+    // key exactly when they are structurally identical.
+    virtual void appendKey(SmallVectorImpl<char>& Key) const = 0;
+    // fold the constants in this subtree and return what replaces it, which
+    // may be this node. T is set to the type the result will have.
+    virtual ExprAST* simplify(Compiler& CG, ValType& T) = 0;
+    // compute the value of this subtree, which only uses numbers, and return
+    // whether that could be done within the budget in CG.
+    virtual bool eval(Compiler& CG, double& V) const = 0;
+    // copy this subtree into A, and count its nodes.
+    virtual ExprAST* clone(BumpPtrAllocator& A) const = 0;
+    virtual unsigned size() const = 0;
+    // the value of this expression, if it is a number.
+    virtual bool getConstant(double& V) const { return false; }
+};
+
+static ArrayRef<ExprAST*> cloneArray(BumpPtrAllocator& A, ArrayRef<ExprAST*> Elts) {
+    SmallVector<ExprAST*, 4> Copies;
+    for (ExprAST* E : Elts) Copies.push_back(E->clone(A));
+    return copyArray<ExprAST*>(A, Copies);
+}
+
+class NumberExprAST : public ExprAST {
+    double Val;
+
+public:
+    NumberExprAST(double Val) : Val(Val){}
+    double getVal() const {return Val;}
+    Value* codegen(Compiler& CG) override;
+    int lower(Compiler& CG, zlang::bc::Builder& B) override;
+    void appendKey(SmallVectorImpl<char>& Key) const override {
+        Key.push_back('N');
+        appendKeyBytes(Key, Val);
+    }
+    ExprAST* simplify(Compiler& CG, ValType& T) override;
+    bool eval(Compiler& CG, double& V) const override;
+    ExprAST* clone(BumpPtrAllocator& A) const override {
+        return makeIn<NumberExprAST>(A, Val);
+    }
+    unsigned size() const override { return 1; }
+    bool getConstant(double& V) const override {
+        V = Val;
+        return true;
+    }
+};
+
+class VariableExprAST : public ExprAST {
+    SymbolID Name;
+
+public: 
+    VariableExprAST(SymbolID Name) : Name(Name) {}
+    Value* codegen(Compiler& CG) override;
+    int lower(Compiler& CG, zlang::bc::Builder& B) override;
+    void appendKey(SmallVectorImpl<char>& Key) const override {
+        Key.push_back('V');
+        appendKeyBytes(Key, Name);
+    }
+    ExprAST* simplify(Compiler& CG, ValType& T) override;
+    bool eval(Compiler& CG, double& V) const override;
+    ExprAST* clone(BumpPtrAllocator& A) const override {
+        return makeIn<VariableExprAST>(A, Name);
+    }
+    unsigned size() const override { return 1; }
+};
+
+class BinaryExprAST : public ExprAST {
+    char Op;
+    ExprAST *LHS, *RHS;
+
+public:
+    BinaryExprAST(char op, ExprAST* LHS, ExprAST* RHS) 
+                  : Op(op), LHS(LHS), RHS(RHS) {}
+    Value* codegen(Compiler& CG) override;
+    int lower(Compiler& CG, zlang::bc::Builder& B) override;
+    void appendKey(SmallVectorImpl<char>& Key) const override {
+        Key.push_back('B');
+        Key.push_back(Op);
+        LHS->appendKey(Key);
+        RHS->appendKey(Key);
+    }
+    ExprAST* simplify(Compiler& CG, ValType& T) override;
+    bool eval(Compiler& CG, double& V) const override;
+    ExprAST* clone(BumpPtrAllocator& A) const override {
+        return makeIn<BinaryExprAST>(A, Op, LHS->clone(A), RHS->clone(A));
+    }
+    unsigned size() const override { return 1 + LHS->size() + RHS->size(); }
+};
+
+class CallExprAST : public ExprAST {
+    SymbolID Callee;
+    ArrayRef<ExprAST*> Args;
+public:
+    CallExprAST(SymbolID Callee, 
+                ArrayRef<ExprAST*> Args)
+                : Callee(Callee), Args(Args) {}
+    Value* codegen(Compiler& CG) override;
+    int lower(Compiler& CG, zlang::bc::Builder& B) override;
+    void appendKey(SmallVectorImpl<char>& Key) const override {
+        Key.push_back('C');
+        appendKeyBytes(Key, Callee);
+        appendKeyBytes(Key, unsigned(Args.size()));
+        for (ExprAST* Arg : Args) Arg->appendKey(Key);
+    }
+    ExprAST* simplify(Compiler& CG, ValType& T) override;
+    bool eval(Compiler& CG, double& V) const override;
+    ExprAST* clone(BumpPtrAllocator& A) const override {
+        return makeIn<CallExprAST>(A, Callee, cloneArray(A, Args));
+    }
+    unsigned size() const override {
+        unsigned N = 1;
+        for (ExprAST* Arg : Args) N += Arg->size();
+        return N;
+    }
+};
+
+// name = value
+class AssignExprAST : public ExprAST {
+    SymbolID Name;
+    ExprAST* Value;
+
+public:
+    AssignExprAST(SymbolID Name, ExprAST* Value) : Name(Name), Value(Value) {}
+    llvm::Value* codegen(Compiler& CG) override;
+    int lower(Compiler& CG, zlang::bc::Builder& B) override;
+    void appendKey(SmallVectorImpl<char>& Key) const override {
+        Key.push_back('A');
+        appendKeyBytes(Key, Name);
+        Value->appendKey(Key);
+    }
+    ExprAST* simplify(Compiler& CG, ValType& T) override;
+    bool eval(Compiler& CG, double& V) const override;
+    ExprAST* clone(BumpPtrAllocator& A) const override {
+        return makeIn<AssignExprAST>(A, Name, Value->clone(A));
+    }
+    unsigned size() const override { return 1 + Value->size(); }
+};
+
+// buf[index], or buf[index] = value when Value is set.
+class IndexExprAST : public ExprAST {
+    SymbolID Name;
+    ExprAST *Index, *Value;
+
+public:
+    IndexExprAST(SymbolID Name, ExprAST* Index, ExprAST* Value)
+        : Name(Name), Index(Index), Value(Value) {}
+    llvm::Value* codegen(Compiler& CG) override;
+    int lower(Compiler& CG, zlang::bc::Builder& B) override;
+    void appendKey(SmallVectorImpl<char>& Key) const override {
+        Key.push_back('X');
+        appendKeyBytes(Key, Name);
+        Index->appendKey(Key);
+        if (Value) Value->appendKey(Key);
+        else Key.push_back('-');
+    }
+    ExprAST* simplify(Compiler& CG, ValType& T) override;
+    bool eval(Compiler& CG, double& V) const override;
+    ExprAST* clone(BumpPtrAllocator& A) const override {
+        return makeIn<IndexExprAST>(A, Name, Index->clone(A), Value ? Value->clone(A) : nullptr);
+    }
+    unsigned size() const override { return 1 + Index->size() + (Value ? Value->size() : 0); }
+};
+
+class IfExprAST : public ExprAST {
+    ExprAST *Cond, *Then, *Else;
+
+public:
+    IfExprAST(ExprAST* Cond, ExprAST* Then, ExprAST* Else)
+        : Cond(Cond), Then(Then), Else(Else) {}
+    Value* codegen(Compiler& CG) override;
+    int lower(Compiler& CG, zlang::bc::Builder& B) override;
+    void appendKey(SmallVectorImpl<char>& Key) const override {
+        Key.push_back('I');
+        Cond->appendKey(Key);
+        Then->appendKey(Key);
+        Else->appendKey(Key);
+    }
+    ExprAST* simplify(Compiler& CG, ValType& T) override;
+    bool eval(Compiler& CG, double& V) const override;
+    ExprAST* clone(BumpPtrAllocator& A) const override {
+        return makeIn<IfExprAST>(A, Cond->clone(A), Then->clone(A), Else->clone(A));
+    }
+    unsigned size() const override { return 1 + Cond->size() + Then->size() + Else->size(); }
+};
+
+class ForExprAST : public ExprAST {
+  SymbolID VarName;
+  ExprAST *Start, *End, *Step, *Body;
+
+public:
+  ForExprAST(SymbolID VarName, ExprAST* Start, ExprAST* End, ExprAST* Step,
+             ExprAST* Body)
+    : VarName(VarName), Start(Start), End(End), Step(Step), Body(Body) {}
+
+  Value* codegen(Compiler& CG) override;
+  int lower(Compiler& CG, zlang::bc::Builder& B) override;
+  void appendKey(SmallVectorImpl<char>& Key) const override {
+    Key.push_back('F');
+    appendKeyBytes(Key, VarName);
+    Start->appendKey(Key);
+    End->appendKey(Key);
+    if (Step) Step->appendKey(Key);
+    else Key.push_back('-');
+    Body->appendKey(Key);
+  }
+  ExprAST* simplify(Compiler& CG, ValType& T) override;
+  bool eval(Compiler& CG, double& V) const override;
+  ExprAST* clone(BumpPtrAllocator& A) const override {
+    return makeIn<ForExprAST>(A, VarName, Start->clone(A), End->clone(A),
+                              Step ? Step->clone(A) : nullptr, Body->clone(A));
+  }
+  unsigned size() const override {
+    return 1 + Start->size() + End->size() + (Step ? Step->size() : 0) + Body->size();
+  }
+};
+
+// var name (= init)?, ... in body. A variable without an initializer is 0.0.
+class VarExprAST : public ExprAST {
+    ArrayRef<std::pair<SymbolID, ExprAST*>> VarNames;
+    ExprAST* Body;
+
+public:
+    VarExprAST(ArrayRef<std::pair<SymbolID, ExprAST*>> VarNames, ExprAST* Body)
+        : VarNames(VarNames), Body(Body) {}
+    Value* codegen(Compiler& CG) override;
+    int lower(Compiler& CG, zlang::bc::Builder& B) override;
+    void appendKey(SmallVectorImpl<char>& Key) const override {
+        Key.push_back('L');
+        appendKeyBytes(Key, unsigned(VarNames.size()));
+        for (auto& Var : VarNames) {
+            appendKeyBytes(Key, Var.first);
+            if (Var.second) Var.second->appendKey(Key);
+            else Key.push_back('-');
+        }
+        Body->appendKey(Key);
+    }
+    ExprAST* simplify(Compiler& CG, ValType& T) override;
+    bool eval(Compiler& CG, double& V) const override;
+    ExprAST* clone(BumpPtrAllocator& A) const override {
+        SmallVector<std::pair<SymbolID, ExprAST*>, 4> Copies;
+        for (auto& Var : VarNames)
+            Copies.push_back({Var.first, Var.second ? Var.second->clone(A) : nullptr});
+        return makeIn<VarExprAST>(A, copyArray<std::pair<SymbolID, ExprAST*>>(A, Copies),
+                                  Body->clone(A));
+    }
+    unsigned size() const override {
+        unsigned N = 1 + Body->size();
+        for (auto& Var : VarNames) N += Var.second ? Var.second->size() : 0;
+        return N;
+    }
+};
+
+class PrototypeAST {
+    SymbolID Name;
+    ArrayRef<SymbolID> Args;
+    ArrayRef<ValType> ArgTypes;
+    ValType RetType;
+public:
+    PrototypeAST(SymbolID Name, ArrayRef<SymbolID> Args,
+                 ArrayRef<ValType> ArgTypes, ValType RetType = ValType::Num)
+                : Name(Name), Args(Args), ArgTypes(ArgTypes), RetType(RetType) {}
+    
+    SymbolID getName() const {return Name;}
+    ArrayRef<SymbolID> getArgs() const {return Args;}
+    ArrayRef<ValType> getArgTypes() const {return ArgTypes;}
+    ValType getRetType() const {return RetType;}
+
+    // true if only doubles go in and out.
+    bool isScalar() const {
+        return RetType == ValType::Num &&
+               all_of(ArgTypes, [](ValType T) { return T == ValType::Num; });
+    }
+    bool takesVec() const { return is_contained(ArgTypes, ValType::Vec); }
+
+    // copy into A, so the prototype can outlive its top-level item.
+    PrototypeAST* clone(BumpPtrAllocator& A) const {
+        return new (A.Allocate<PrototypeAST>())
+            PrototypeAST(Name, copyArray(A, Args), copyArray(A, ArgTypes), RetType);
+    }
+
+    FunctionType* getFunctionType(Compiler& CG) const;
+    Function* codegen(Compiler& CG);
+};
+
+class FunctionAST {
+    PrototypeAST *Proto;
+    ExprAST *Body;
+    // 'def fast': floating point in the body may be reassociated and fused.
+    bool Fast;
+    // 'def memo': calls go through a table of recent results. Also set by
+    // codegen() when --memoize picks the function.
+    bool Memo;
+
+public:
+    FunctionAST(PrototypeAST* Proto, ExprAST* Body, bool Fast = false, bool Memo = false)
+               : Proto(Proto), Body(Body), Fast(Fast), Memo(Memo) {}
+    ExprAST* getBody() const {return Body;}
+    const PrototypeAST& getProto() const {return *Proto;}
+    bool isMemo() const {return Memo;}
+    FunctionAST* clone(BumpPtrAllocator& A) const {
+        return makeIn<FunctionAST>(A, Proto->clone(A), Body->clone(A), Fast, Memo);
+    }
+    // replace the body with ExprAST::simplify() of it.
+    void simplify(Compiler& CG);
+    Function* codegen(Compiler& CG);
+    // emit E as the body of F, the declaration of this function, returning
+    // its value as F returns it.
+    Value* codegenBody(Compiler& CG, Function& F, ExprAST& E);
+    // lower into F, whose parameters are bound from the prototype.
+    bool lower(Compiler& CG, zlang::bc::Function& F);
+};
+
+
+
+int Compiler::getNextToken() {
+    if (!Timers) return CurTok = gettoken();
+    auto Start = TimeReport::Clock::now();
+    CurTok = gettoken();
+    Timers->addLexTime(TimeReport::Clock::now() - Start);
+    return CurTok;
+}
+
+ExprAST* Compiler::LogError(const char* Str) {
+    if (Opts.Echo) fprintf(stderr, "Error: %s\n", Str);
+    Diagnostics.push_back(Diagnostic{ItemLine ? ItemLine : TokLine, Str});
+    return nullptr;
+}
+
+PrototypeAST* Compiler::LogErrorP(const char* Str) {
+    LogError(Str);
+    return nullptr;
+}
+
+// Parser
+
+// numberexpr ::= number
+ExprAST* Compiler::ParseNumberExpr() {
+    auto Result = make<NumberExprAST>(NumVal);
+    getNextToken();
+    return Result;
+}
+
+// parenexpr ::= '(' expression ')'
+ExprAST* Compiler::ParseParenExpr() {
+    getNextToken(); // eat'('
+    auto V = ParseExpression();
+    if (!V) return nullptr;
+    if (CurTok == ')') {
+        getNextToken(); // eat')'
+        return V;
+    } else {
+        return LogError("expected ')'");
+    }
+}
+
+/* identifierexpr
+ *   ::= identifier
+ *   ::= identifier '=' expression
+ *   ::= identifier '(' expression* ')'
+ *   ::= identifier '[' expression ']' ('=' expression)? */
+ExprAST* Compiler::ParseIdentifierExpr() {
+    SymbolID IdName = IdentifierID;
+
+    getNextToken(); // eat identifier
+
+    if (CurTok == '=') { // assignment
+        getNextToken();  // eat '='
+        auto Value = ParseExpression();
+        if (!Value) return nullptr;
+        return make<AssignExprAST>(IdName, Value);
+    }
+
+    if (CurTok == '[') { // buffer element
+        getNextToken();  // eat '['
+        auto Index = ParseExpression();
+        if (!Index) return nullptr;
+        if (CurTok != ']') return LogError("expected ']'");
+        getNextToken();  // eat ']'
+
+        ExprAST* Value = nullptr;
+        if (CurTok == '=') {
+            getNextToken();  // eat '='
+            Value = ParseExpression();
+            if (!Value) return nullptr;
+        }
+        return make<IndexExprAST>(IdName, Index, Value);
+    }
+    
+    if (CurTok == '(') { // function calls
+        getNextToken();  // eat '('
+        SmallVector<ExprAST*, 8> Args;
+        if (CurTok != ')') {
+            while (true) {
+                if (auto Arg =ParseExpression()) {
+                    Args.push_back(Arg);
+                } else return nullptr;
+
+                if (CurTok == ')') {
+                    getNextToken(); // eat')'
+                    return make<CallExprAST>(IdName, copyArray<ExprAST*>(ASTArena, Args));
+                }
+                else if (CurTok == ',') {
+                    getNextToken(); // eat ','
+                    continue;
+                } else {
+                    return LogError("Expected ')' or ',' in argument list");
+                } 
+            }
+        } else {
+            getNextToken();
+            return make<CallExprAST>(IdName, copyArray<ExprAST*>(ASTArena, Args));
+        }
+    } else { // simple variable ref
+        return make<VariableExprAST>(IdName);
+    }
+}
+
+ExprAST* Compiler::ParseIfExpr() {
+    getNextToken(); //eat "if"
+
+    // condition
+    auto Cond = ParseExpression();
+    if (!Cond) return nullptr;
+    if (CurTok != tok_then) return LogError("expected then");
+
+    getNextToken(); // eat "then"
+
+    auto Then = ParseExpression();
+    if (!Then) return nullptr;
+    if (CurTok != tok_else) return LogError("expected else");
+    getNextToken(); // eat "else"
+
+    auto Else = ParseExpression();
+    if (!Else) return nullptr;
+    
+    return make<IfExprAST>(Cond, Then, Else);
+}
+
+// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
+ExprAST* Compiler::ParseForExpr() {
+    getNextToken();  // eat the for
+
+    if (CurTok != tok_identifier) return LogError("expected identifier after for");
+
+    SymbolID IdName = IdentifierID;
+    getNextToken();  // eat identifier
+
+    if (CurTok != '=') return LogError("expected '=' after for");
+    getNextToken();  // eat '='
+
+    auto Start = ParseExpression();
+    if (!Start) return nullptr;
+    if (CurTok != ',') return LogError("expected ',' after for start value");
+    getNextToken();
+
+    auto End = ParseExpression();
+    if (!End) return nullptr;
+
+    // the step value is optional.
+    ExprAST* Step = nullptr;
+    if (CurTok == ',') {
+        getNextToken();
+        Step = ParseExpression();
+        if (!Step) return nullptr;
+    }
+
+    if (CurTok != tok_in) return LogError("expected 'in' after for");
+    getNextToken();  // eat 'in'
+
+    auto Body = ParseExpression();
+    if (!Body) return nullptr;
+
+    return make<ForExprAST>(IdName, Start, End, Step, Body);
+    }
+
+
+// varexpr ::= 'var' identifier ('=' expression)?
+//                    (',' identifier ('=' expression)?)* 'in' expression
+ExprAST* Compiler::ParseVarExpr() {
+    getNextToken();  // eat the var
+
+    SmallVector<std::pair<SymbolID, ExprAST*>, 4> VarNames;
+    if (CurTok != tok_identifier) return LogError("expected identifier after var");
+
+    while (true) {
+        SymbolID Name = IdentifierID;
+        getNextToken();  // eat identifier
+
+        // read the optional initializer.
+        ExprAST* Init = nullptr;
+        if (CurTok == '=') {
+            getNextToken();  // eat the '='
+            Init = ParseExpression();
+            if (!Init) return nullptr;
+        }
+        VarNames.push_back(std::make_pair(Name, Init));
+
+        // end of var list, exit loop.
+        if (CurTok != ',') break;
+        getNextToken();  // eat the ','
+
+        if (CurTok != tok_identifier) return LogError("expected identifier list after var");
+    }
+
+    if (CurTok != tok_in) return LogError("expected 'in' keyword after 'var'");
+    getNextToken();  // eat 'in'
+
+    auto Body = ParseExpression();
+    if (!Body) return nullptr;
+
+    return make<VarExprAST>(copyArray<std::pair<SymbolID, ExprAST*>>(ASTArena, VarNames), Body);
+}
+
+ExprAST* Compiler::ParsePrimary() {
+    switch (CurTok) {
+        case tok_identifier:
+            return ParseIdentifierExpr();
+        case tok_number:
+            return ParseNumberExpr();
+        case '(':
+            return ParseParenExpr();
+        case tok_if:
+            return ParseIfExpr();
+        case tok_for:
+            return ParseForExpr();
+        case tok_var:
+            return ParseVarExpr();
+        default: 
+            return LogError("unknown token when expecting an expression");
+    }
+}
+
+int Compiler::GetTokPrecedence() {
+    if (CurTok < 0 || CurTok > 255) return -1;
+    int TokPrec = BinopPrecedence.Prec[CurTok];
+    if (TokPrec <= 0) return -1;
+    else return TokPrec;
+}
+
+void Compiler::InstallBinop(unsigned char Op, int Prec) {
+    BinopPrecedence.Prec[Op] = Prec;
+}
+
+// expression ::= primary binoprhs([binop,primaryexpr])
+ExprAST* Compiler::ParseExpression() {
+    auto LHS = ParsePrimary();
+    if (!LHS) return nullptr;
+    return ParseBinOpRHS(0, LHS);
+}
+
+// binoprhs ::= ('+' primary)*
+ExprAST* Compiler::ParseBinOpRHS(int ExprPrec, ExprAST* LHS) {
+    while (true) {
+        int TokPrec = GetTokPrecedence();
+        if (TokPrec < ExprPrec) return LHS;
+        else {
+            int BinOp = CurTok; 
+            getNextToken();  // eat binop
+            auto RHS = ParsePrimary();
+            if (!RHS) return nullptr;
+            else {
+                int NextPrec = GetTokPrecedence();
+                if (TokPrec < NextPrec) {
+                    RHS = ParseBinOpRHS(TokPrec + 1, RHS);
+                    if (!RHS) return nullptr;
+                }
+                LHS = make<BinaryExprAST>(BinOp, LHS, RHS);
+            }
+        }
+    }
+}
+
+
+// type ::= (':' ('vec' | 'buf'))?
+bool Compiler::ParseType(ValType& T) {
+    T = ValType::Num;
+    if (CurTok != ':') return true;
+    getNextToken(); // eat ':'
+    if (CurTok == tok_vec) T = ValType::Vec;
+    else if (CurTok == tok_buf) T = ValType::Buf;
+    else {
+        LogError("Expected 'vec' or 'buf' after ':'");
+        return false;
+    }
+    getNextToken(); // eat the type
+    return true;
+}
+
+// prototype ::= id '(' (id type)* ')' type
+PrototypeAST* Compiler::ParsePrototype() {
+    if (CurTok != tok_identifier) return LogErrorP("Expected function name in prototype");
+    SymbolID FnName = IdentifierID;
+    if (getBuiltin(FnName) != BI_None) return LogErrorP("Cannot redefine a builtin");
+    getNextToken();
+    if (CurTok != '(') return LogErrorP("Expected '(' in prototype");
+
+    SmallVector<SymbolID, 8> ArgNames;
+    SmallVector<ValType, 8> ArgTypes;
+    getNextToken(); // eat '('
+    while (CurTok == tok_identifier) {
+        ArgNames.push_back(IdentifierID);
+        getNextToken();
+        ArgTypes.emplace_back();
+        if (!ParseType(ArgTypes.back())) return nullptr;
+    }
+    if (CurTok != ')') return LogErrorP("Expected ')' in prototype");
+    getNextToken(); // eat ')'
+
+    ValType RetType;
+    if (!ParseType(RetType)) return nullptr;
+    if (RetType == ValType::Buf) return LogErrorP("Functions cannot return a buf");
+    return make<PrototypeAST>(FnName, copyArray<SymbolID>(ASTArena, ArgNames),
+                              copyArray<ValType>(ASTArena, ArgTypes), RetType);
+}
+
+// definition ::= 'def' ('fast' | 'memo')* prototype expression
+FunctionAST* Compiler::ParseDefinition() {
+    getNextToken(); // eat def
+    bool Fast = false, Memo = false;
+    for (;; getNextToken()) {
+        if (CurTok == tok_fast) Fast = true;
+        else if (CurTok == tok_memo) Memo = true;
+        else break;
+    }
+    auto Proto = ParsePrototype();
+    if (!Proto) return nullptr;
+    // results are keyed on the bits of the arguments.
+    if (Memo && !Proto->isScalar()) {
+        LogError("memo functions must only take and return numbers");
+        return nullptr;
+    }
+    if (auto E = ParseExpression()) {
+        return make<FunctionAST>(Proto, E, Fast, Memo);
+    } else return nullptr;
+}
+
+// external ::= 'extern' prototype
+PrototypeAST* Compiler::ParseExtern() {
+  getNextToken();  // eat extern.
+  return ParsePrototype();
+}
+
+// toplevelexpr ::= expression
+FunctionAST* Compiler::ParseTopLevelExpr() {
+    if (auto E = ParseExpression()) {
+        auto Proto = make<PrototypeAST>(Symbols.intern("__anon_expr"), ArrayRef<SymbolID>(),
+                                        ArrayRef<ValType>());
+        return make<FunctionAST>(Proto, E);
+    } else return nullptr;
+}
+
+/****** Code Generation ******/
+llvm::Value* Compiler::LogErrorV(const char* Str) {
+    LogError(Str);
+    return nullptr;
+}
+
+bool Compiler::failed(Error Err) {
+    if (!Err) return false;
+    LogError(toString(std::move(Err)).c_str());
+    return true;
+}
+
+void Compiler::ReportJITErrors() {
+    std::vector<std::string> Errors;
+    {
+        std::lock_guard<std::mutex> Lock(JITErrorsMutex);
+        Errors.swap(JITErrors);
+    }
+    for (const std::string& E : Errors) LogError(E.c_str());
+}
+
+Error Compiler::withJITErrors(Error Err) {
+    std::lock_guard<std::mutex> Lock(JITErrorsMutex);
+    for (const std::string& E : JITErrors)
+        Err = joinErrors(createStringError(inconvertibleErrorCode(), E), std::move(Err));
+    JITErrors.clear();
+    return Err;
+}
+
+// a buf is held in a {double*, i64} value, but passed as two arguments.
+Type* Compiler::getLLVMType(ValType T) {
+    Type* D = Type::getDoubleTy(*TheContext);
+    switch (T) {
+        case ValType::Num: return D;
+        case ValType::Vec: return FixedVectorType::get(D, Opts.VectorWidth);
+        case ValType::Buf:
+            return StructType::get(*TheContext, {D->getPointerTo(), Type::getInt64Ty(*TheContext)});
+    }
+    llvm_unreachable("unknown type");
+}
+
+// create an alloca in the entry block of TheFunction, where mem2reg and SROA
+// look for promotable slots.
+static AllocaInst* CreateEntryBlockAlloca(Function* TheFunction, Type* Ty,
+                                          StringRef VarName) {
+    IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
+                     TheFunction->getEntryBlock().begin());
+    return TmpB.CreateAlloca(Ty, nullptr, VarName);
+}
+
+static bool isNum(Value* V) { return V->getType()->isDoubleTy(); }
+static bool isVec(Value* V) { return V->getType()->isVectorTy(); }
+static bool isBuf(Value* V) { return V->getType()->isStructTy(); }
+
+// convert V to type To at the insertion point, splatting a double into a vec.
+// Returns null if there is no conversion.
+Value* Compiler::coerce(Value* V, Type* To) {
+    if (V->getType() == To) return V;
+    if (To->isVectorTy() && isNum(V))
+        return Builder->CreateVectorSplat(Opts.VectorWidth, V, "splat");
+    return nullptr;
+}
+
+// write out a module holding a copy of F, with Linkage, and declarations of
+// what it calls.
+std::string Compiler::SnapshotFunction(Function& F, GlobalValue::LinkageTypes Linkage) {
+    Module M(F.getName(), *TheContext);
+    M.setDataLayout(TheModule->getDataLayout());
+    // without this, reading the bitcode back warns and strips metadata.
+    M.addModuleFlag(Module::Warning, "Debug Info Version", DEBUG_METADATA_VERSION);
+    Function* NewF = Function::Create(F.getFunctionType(), Linkage, F.getName(), &M);
+    ValueToValueMapTy VMap;
+    VMap[&F] = NewF;
+
+    // the internal functions and globals F uses, such as the body and table
+    // of a memo function, are copied along with it. Other functions it
+    // refers to are declared.
+    SmallVector<Function*, 4> Bodies = {&F};
+    SmallVector<GlobalVariable*, 4> Globals;
+    SmallVector<Constant*, 16> Worklist;
+    SmallPtrSet<Constant*, 16> Seen;
+    auto Visit = [&](Constant* C) {
+        if (!Seen.insert(C).second) return;
+        if (auto* Fn = dyn_cast<Function>(C)) {
+            if (VMap.count(Fn)) return;
+            bool Local = Fn->hasLocalLinkage();
+            Function* Copy = Function::Create(Fn->getFunctionType(),
+                                              Local ? Fn->getLinkage() : Function::ExternalLinkage,
+                                              Fn->getName(), &M);
+            Copy->copyAttributesFrom(Fn);
+            VMap[Fn] = Copy;
+            if (Local) Bodies.push_back(Fn);
+        } else if (auto* GV = dyn_cast<GlobalVariable>(C)) {
+            bool Local = GV->hasLocalLinkage();
+            auto* Copy = new GlobalVariable(M, GV->getValueType(), GV->isConstant(),
+                                            Local ? GV->getLinkage() : GlobalValue::ExternalLinkage,
+                                            nullptr, GV->getName());
+            Copy->copyAttributesFrom(GV);
+            VMap[GV] = Copy;
+            if (Local && GV->hasInitializer()) {
+                Globals.push_back(GV);
+                Worklist.push_back(GV->getInitializer());
+            }
+        } else {
+            for (Value* Op : C->operands()) Worklist.push_back(cast<Constant>(Op));
+        }
+    };
+    for (unsigned i = 0; i != Bodies.size(); i++) {
+        for (Instruction& I : instructions(*Bodies[i]))
+            for (Value* Op : I.operands())
+                if (auto* C = dyn_cast<Constant>(Op)) Worklist.push_back(C);
+        while (!Worklist.empty()) Visit(Worklist.pop_back_val());
+    }
+    for (GlobalVariable* GV : Globals)
+        cast<GlobalVariable>(VMap[GV])->setInitializer(MapValue(GV->getInitializer(), VMap));
+
+    for (Function* Fn : Bodies) {
+        auto* Copy = cast<Function>(VMap[Fn]);
+        auto NewArg = Copy->arg_begin();
+        for (Argument& Arg : Fn->args()) {
+            NewArg->setName(Arg.getName());
+            VMap[&Arg] = &*NewArg++;
+        }
+        SmallVector<ReturnInst*, 4> Returns;
+        CloneFunctionInto(Copy, Fn, VMap, CloneFunctionChangeType::DifferentModule, Returns);
+    }
+    NewF->setLinkage(Linkage);
+
+    std::string Bitcode;
+    raw_string_ostream OS(Bitcode);
+    WriteBitcodeToFile(M, OS);
+    return OS.str();
+}
+
+// keep a copy of F, as optimized so far, for later modules to inline.
+void Compiler::SaveInlineBody(Function& F) {
+    if (F.getInstructionCount() > Opts.ImportLimit) return;
+    InlineBodies[F.getName()] = SnapshotFunction(F, Function::AvailableExternallyLinkage);
+}
+
+// link a saved body into TheModule, along with those of the small functions
+// it calls. The JIT's inliner can then use them, and calls that are not
+// inlined still go to the compiled definitions.
+Function* Compiler::ImportInlineBody(StringRef Name) {
+    auto I = InlineBodies.find(Name);
+    if (I == InlineBodies.end()) return nullptr;
+
+    auto M = parseBitcodeFile(MemoryBufferRef(I->second, Name), *TheContext);
+    if (!M) {
+        consumeError(M.takeError());
+        return nullptr;
+    }
+    // bodies from a library are saved with external linkage.
+    if (Function* F = (*M)->getFunction(Name)) F->setLinkage(Function::AvailableExternallyLinkage);
+    if (Linker::linkModules(*TheModule, std::move(*M))) return nullptr;
+    Function* F = TheModule->getFunction(Name);
+
+    // a body is saved before anything is inlined into it. linking replaces
+    // declarations, so collect the callees first.
+    SmallVector<std::string, 4> Callees;
+    for (Instruction& I : instructions(*F))
+        if (auto* CB = dyn_cast<CallBase>(&I))
+            if (Function* Callee = CB->getCalledFunction())
+                if (Callee->isDeclaration() && InlineBodies.count(Callee->getName()))
+                    Callees.push_back(Callee->getName().str());
+    for (const std::string& Callee : Callees)
+        if (TheModule->getFunction(Callee)->isDeclaration()) ImportInlineBody(Callee);
+    return F;
+}
+
+Function* Compiler::getFunction(SymbolID Name) {
+    StringRef FnName = Symbols.name(Name);
+    Function* F = TheModule->getFunction(FnName);
+    if (!F) {
+        auto* P = FunctionProtos.lookup(Name);
+        if (!P) return nullptr;
+        F = P->codegen(*this);
+    }
+
+    // the linker only brings in an available_externally body to replace an
+    // existing declaration.
+    if (F->isDeclaration()) {
+        if (Function* Imported = ImportInlineBody(FnName)) return Imported;
+    }
+    return F;
+}
+
+Value* NumberExprAST::codegen(Compiler& CG) {
+    return ConstantFP::get(*CG.TheContext, APFloat(Val));
+}
+
+Value* VariableExprAST::codegen(Compiler& CG) {
+    AllocaInst* A = CG.NameValues.lookup(Name);
+    if (!A) return CG.LogErrorV("Unknown variable name");
+    return CG.Builder->CreateLoad(A->getAllocatedType(), A, CG.Symbols.name(Name));
+}
+
+Value* AssignExprAST::codegen(Compiler& CG) {
+    AllocaInst* A = CG.NameValues.lookup(Name);
+    if (!A) return CG.LogErrorV("Unknown variable name");
+
+    llvm::Value* V = Value->codegen(CG);
+    if (!V) return nullptr;
+    V = CG.coerce(V, A->getAllocatedType());
+    if (!V) return CG.LogErrorV("Assigned value does not match the variable's type");
+    CG.Builder->CreateStore(V, A);
+    return V;
+}
+
+Value* BinaryExprAST::codegen(Compiler& CG) {
+    Value *L = LHS->codegen(CG);
+    Value *R = RHS->codegen(CG);
+    if (!L || !R) return nullptr;
+    if (isBuf(L) || isBuf(R)) return CG.LogErrorV("Cannot use a buf as a value");
+
+    // a double operand is applied to every lane of a vec one.
+    if (R->getType()->isVectorTy()) L = CG.coerce(L, R->getType());
+    else R = CG.coerce(R, L->getType());
+
+    switch (Op) {
+        case '+':
+            return CG.Builder->CreateFAdd(L, R, "addtmp");
+        case '-':
+            return CG.Builder->CreateFSub(L, R, "subtmp");
+        case '*':
+            return CG.Builder->CreateFMul(L, R, "multmp");
+        case '<':
+            L = CG.Builder->CreateFCmpULT(L, R, "cmptmp");
+            // conver bool 0/1 to double 0.0/1.0, lane-wise for vectors
+            return CG.Builder->CreateUIToFP(L, R->getType(), "booltmp");
+        default:
+            return CG.LogErrorV("invalid binary operator");
+    }
+}
+
+Value* Compiler::codegenBuiltin(Builtin BI, ArrayRef<ExprAST*> Args) {
+    if (Args.size() != BuiltinArity[BI])
+        return LogErrorV("Incorrect # arguments passed");
+
+    Value* Ops[3];
+    for (unsigned i = 0, e = Args.size(); i != e; i++) {
+        Ops[i] = Args[i]->codegen(*this);
+        if (!Ops[i]) return nullptr;
+    }
+    Type* VecTy = getLLVMType(ValType::Vec);
+
+    // splat(x), extract(v, i), insert(v, i, x), hsum(v) and len(b). Lane
+    // indices are truncated and wrapped to the vector width.
+    auto LaneIndex = [&](Value* I) {
+        I = Builder->CreateFPToSI(I, Builder->getInt32Ty(), "lane");
+        return Builder->CreateAnd(I, Opts.VectorWidth - 1, "lane");
+    };
+    switch (BI) {
+        case BI_Splat:
+            if (!isNum(Ops[0])) return LogErrorV("splat expects a number");
+            return coerce(Ops[0], VecTy);
+        case BI_Extract:
+            if (!isVec(Ops[0]) || !isNum(Ops[1]))
+                return LogErrorV("extract expects a vec and a lane number");
+            return Builder->CreateExtractElement(Ops[0], LaneIndex(Ops[1]), "extract");
+        case BI_Insert:
+            if (!isVec(Ops[0]) || !isNum(Ops[1]) || !isNum(Ops[2]))
+                return LogErrorV("insert expects a vec, a lane number and a number");
+            return Builder->CreateInsertElement(Ops[0], Ops[2], LaneIndex(Ops[1]), "insert");
+        case BI_HSum:
+            if (!isVec(Ops[0])) return LogErrorV("hsum expects a vec");
+            // lanes are added in order, starting from -0.0 (the fadd identity)
+            return Builder->CreateFAddReduce(
+                ConstantFP::getNegativeZero(Builder->getDoubleTy()), Ops[0]);
+        case BI_Len:
+            if (!isBuf(Ops[0])) return LogErrorV("len expects a buf");
+            return Builder->CreateSIToFP(Builder->CreateExtractValue(Ops[0], 1),
+                                         Builder->getDoubleTy(), "len");
+        case BI_None:
+            break;
+    }
+    llvm_unreachable("unknown builtin");
+}
+
+Value* CallExprAST::codegen(Compiler& CG) {
+    Builtin BI = getBuiltin(Callee);
+    if (BI != BI_None) return CG.codegenBuiltin(BI, Args);
+
+    Function* CalleeF = CG.getFunction(Callee);
+    if (!CalleeF) return CG.LogErrorV("Unknown function referenced");
+    CG.CallsDefinition = true;
+    if (CG.Impure.lookup(Callee)) CG.CallsImpure = true;
+    // the prototype has the zlang types; a buf takes two LLVM arguments.
+    ArrayRef<ValType> ParamTypes = CG.FunctionProtos.lookup(Callee)->getArgTypes();
+    if (ParamTypes.size() != Args.size()) 
+        return CG.LogErrorV("Incorrect # arguments passed");
+    
+    std::vector<Value*> ArgsV;
+    for (unsigned i = 0, e = Args.size(); i != e; i++) {
+        Value* V = Args[i]->codegen(CG);
+        if (!V) return nullptr;
+        if (ParamTypes[i] == ValType::Buf) {
+            if (!isBuf(V)) return CG.LogErrorV("Expected a buf argument");
+            ArgsV.push_back(CG.Builder->CreateExtractValue(V, 0));
+            ArgsV.push_back(CG.Builder->CreateExtractValue(V, 1));
+            continue;
+        }
+        V = CG.coerce(V, CG.getLLVMType(ParamTypes[i]));
+        if (!V) return CG.LogErrorV("Argument type mismatch");
+        ArgsV.push_back(V);
+    }
+
+    return CG.Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+
+}
+
+// elements are loaded and stored as naturally aligned doubles. The index is
+// not bounds checked.
+Value* IndexExprAST::codegen(Compiler& CG) {
+    AllocaInst* A = CG.NameValues.lookup(Name);
+    if (!A) return CG.LogErrorV("Unknown variable name");
+    llvm::Value* Buf = CG.Builder->CreateLoad(A->getAllocatedType(), A, CG.Symbols.name(Name));
+    if (!isBuf(Buf)) return CG.LogErrorV("Cannot index a value that is not a buf");
+
+    llvm::Value* I = Index->codegen(CG);
+    if (!I) return nullptr;
+    if (!isNum(I)) return CG.LogErrorV("Index must be a number");
+    I = CG.Builder->CreateFPToSI(I, CG.Builder->getInt64Ty(), "idx");
+
+    Type* D = CG.Builder->getDoubleTy();
+    llvm::Value* Ptr = CG.Builder->CreateInBoundsGEP(
+        D, CG.Builder->CreateExtractValue(Buf, 0), I, "elt");
+    if (!Value) return CG.Builder->CreateAlignedLoad(D, Ptr, Align(8), "load");
+
+    llvm::Value* V = Value->codegen(CG);
+    if (!V) return nullptr;
+    if (!isNum(V)) return CG.LogErrorV("Only numbers can be stored in a buf");
+    CG.Builder->CreateAlignedStore(V, Ptr, Align(8));
+    return V;
+}
+
+Value *IfExprAST::codegen(Compiler& CG) {
+    Value *CondV = Cond->codegen(CG);
+    if (!CondV) return nullptr;
+    if (!isNum(CondV)) return CG.LogErrorV("Condition must be a number");
+
+    // convert condition to a bool by comparing non-equal to 0.0.
+    CondV = CG.Builder->CreateFCmpONE(
+        CondV, ConstantFP::get(*CG.TheContext, APFloat(0.0)), "ifcond");
+
+    Function* TheFunction = CG.Builder->GetInsertBlock()->getParent();
+
+    // create blocks for the then and else cases. 
+    // Insert the 'then' block at the end of the function.
+    BasicBlock* ThenBB  = BasicBlock::Create(*CG.TheContext, "then", TheFunction);
+    BasicBlock* ElseBB  = BasicBlock::Create(*CG.TheContext, "else");
+    BasicBlock* MergeBB = BasicBlock::Create(*CG.TheContext, "ifcont");
+
+    BranchInst* Br = CG.Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+    unsigned ThenCount = 0, ElseCount = 0;
+    if (CG.Profiling) {
+        ThenCount = CG.newCounter();
+        ElseCount = CG.newCounter();
+        CG.profileBranch(Br, "if", ThenCount, ElseCount);
+    }
+
+    // emit then value.
+    CG.Builder->SetInsertPoint(ThenBB);
+    if (CG.Profiling) CG.emitCount(ThenCount);
+
+    Value* ThenV = Then->codegen(CG);
+    if (!ThenV) return nullptr;
+
+    CG.Builder->CreateBr(MergeBB);
+    // codegen of 'Then' can change the current block, update ThenBB for the PHI.
+    ThenBB = CG.Builder->GetInsertBlock();
+
+    // emit else block.
+    TheFunction->getBasicBlockList().push_back(ElseBB);
+    CG.Builder->SetInsertPoint(ElseBB);
+    if (CG.Profiling) CG.emitCount(ElseCount);
+
+    Value* ElseV = Else->codegen(CG);
+    if (!ElseV) return nullptr;
+
+    CG.Builder->CreateBr(MergeBB);
+    // codegen of 'Else' can change the current block, update ElseBB for the PHI.
+    ElseBB = CG.Builder->GetInsertBlock();
+
+    // if one side is a vec, splat the other at the end of its block.
+    if (ThenV->getType() != ElseV->getType()) {
+        IRBuilderBase::InsertPointGuard Guard(*CG.Builder);
+        if (isVec(ElseV)) {
+            CG.Builder->SetInsertPoint(ThenBB->getTerminator());
+            ThenV = CG.coerce(ThenV, ElseV->getType());
+        } else {
+            CG.Builder->SetInsertPoint(ElseBB->getTerminator());
+            ElseV = CG.coerce(ElseV, ThenV->getType());
+        }
+        if (!ThenV || !ElseV) return CG.LogErrorV("if branches have different types");
+    }
+
+    // emit merge block.
+    TheFunction->getBasicBlockList().push_back(MergeBB);
+    CG.Builder->SetInsertPoint(MergeBB);
+    PHINode* PN = CG.Builder->CreatePHI(ThenV->getType(), 2, "iftmp");
+
+    PN->addIncoming(ThenV, ThenBB);
+    PN->addIncoming(ElseV, ElseBB);
+    return PN;
+}
+
+/* Output for-loop as:
+ *   var = alloca double
+ *   ...
+ *   start = startexpr
+ *   store start -> var
+ *   goto loop
+ * loop:
+ *   ...
+ *   bodyexpr
+ *   ...
+ * loopend:
+ *   step = stepexpr
+ *   endcond = endexpr
+ *   curvar = load var
+ *   nextvar = curvar + step
+ *   store nextvar -> var
+ *   br endcond, loop, endloop
+ * outloop: 
+ */
+Value* ForExprAST::codegen(Compiler& CG) {
+    // emit the start code first, without 'variable' in scope.
+    Value *StartVal = Start->codegen(CG);
+    if (!StartVal) return nullptr;
+    if (!isNum(StartVal)) return CG.LogErrorV("Loop start must be a number");
+
+    // create an alloca for the variable in the entry block and store into it.
+    Function *TheFunction = CG.Builder->GetInsertBlock()->getParent();
+    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, CG.Builder->getDoubleTy(), CG.Symbols.name(VarName));
+    CG.Builder->CreateStore(StartVal, Alloca);
+
+    // make the new basic block for the loop header, inserting after current block
+    BasicBlock *LoopBB = BasicBlock::Create(*CG.TheContext, "loop", TheFunction);
+
+    // count the times the loop is entered, and its iterations, which also
+    // make the function hot.
+    unsigned EnterCount = 0, IterCount = 0;
+    if (CG.Profiling) {
+        EnterCount = CG.newCounter();
+        IterCount = CG.newCounter();
+        CG.emitCount(EnterCount);
+    }
+
+    // insert an explicit fall through from the current block to the LoopBB.
+    CG.Builder->CreateBr(LoopBB);
+
+    // start insertion in LoopBB.
+    CG.Builder->SetInsertPoint(LoopBB);
+    if (CG.Profiling) {
+        CG.emitCount(0);
+        CG.emitCount(IterCount);
+    }
+
+    // within the loop, the variable refers to the alloca.
+    // if it shadows an existing variable, we have to restore it, so save it now.
+    AllocaInst *OldVal = CG.NameValues.lookup(VarName);
+    CG.NameValues.set(VarName, Alloca);
+
+    // emit the body of the loop
+    if (!Body->codegen(CG)) return nullptr;
+
+    // emit the step value.
+    Value *StepVal = nullptr;
+    if (Step) {
+        StepVal = Step->codegen(CG);
+        if (!StepVal) return nullptr;
+        if (!isNum(StepVal)) return CG.LogErrorV("Loop step must be a number");
+    } else {
+        // if not specified, use 1.0.
+        StepVal = ConstantFP::get(*CG.TheContext, APFloat(1.0));
+    }
+
+    // compute the end condition.
+    Value* EndCond = End->codegen(CG);
+    if (!EndCond) return nullptr;
+    if (!isNum(EndCond)) return CG.LogErrorV("Loop condition must be a number");
+
+    // reload, increment, and restore the alloca. the body may have assigned
+    // to the variable.
+    Value* CurVar = CG.Builder->CreateLoad(Alloca->getAllocatedType(), Alloca, CG.Symbols.name(VarName));
+    Value* NextVar = CG.Builder->CreateFAdd(CurVar, StepVal, "nextvar");
+    CG.Builder->CreateStore(NextVar, Alloca);
+
+    // convert condition to a bool by comparing non-equal to 0.0.
+    EndCond = CG.Builder->CreateFCmpONE(EndCond, ConstantFP::get(*CG.TheContext, APFloat(0.0)), "loopcond");
+
+    // create the "after loop" block and insert it.
+    BasicBlock *AfterBB = BasicBlock::Create(*CG.TheContext, "afterloop", TheFunction);
+
+    // insert the conditional branch into the end of LoopEndBB.
+    BranchInst* Br = CG.Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
+    if (CG.Profiling) CG.profileBranch(Br, "loop", IterCount, EnterCount);
+
+    // new code will be inserted in AfterBB.
+    CG.Builder->SetInsertPoint(AfterBB);
+
+    // restore the unshadowed variable.
+    if (OldVal) CG.NameValues.set(VarName, OldVal);
+    else CG.NameValues.erase(VarName);
+
+    // for expr always returns 0.0.
+    return Constant::getNullValue(Type::getDoubleTy(*CG.TheContext));
+}
+
+
+FunctionType* PrototypeAST::getFunctionType(Compiler& CG) const {
+    std::vector<Type*> Params;
+    for (ValType T : ArgTypes) {
+        Type* Ty = CG.getLLVMType(T);
+        if (auto* Pair = dyn_cast<StructType>(Ty))
+            Params.insert(Params.end(), Pair->element_begin(), Pair->element_end());
+        else
+            Params.push_back(Ty);
+    }
+    return FunctionType::get(CG.getLLVMType(RetType), Params, false);
+}
+
+Value* VarExprAST::codegen(Compiler& CG) {
+    Function* TheFunction = CG.Builder->GetInsertBlock()->getParent();
+
+    // register all variables and emit their initializer.
+    SmallVector<AllocaInst*, 4> OldBindings;
+    for (auto& Var : VarNames) {
+        // emit the initializer before adding the variable to scope, this
+        // prevents the initializer from referencing the variable itself.
+        Value* InitVal;
+        if (Var.second) {
+            InitVal = Var.second->codegen(CG);
+            if (!InitVal) return nullptr;
+        } else {
+            InitVal = ConstantFP::get(*CG.TheContext, APFloat(0.0));
+        }
+
+        AllocaInst* Alloca = CreateEntryBlockAlloca(TheFunction, InitVal->getType(), CG.Symbols.name(Var.first));
+        CG.Builder->CreateStore(InitVal, Alloca);
+
+        // remember the old variable binding so that we can restore it.
+        OldBindings.push_back(CG.NameValues.lookup(Var.first));
+        CG.NameValues.set(Var.first, Alloca);
+    }
+
+    Value* BodyVal = Body->codegen(CG);
+
+    // pop all our variables from scope, innermost first.
+    for (unsigned i = VarNames.size(); i-- != 0;) {
+        if (OldBindings[i]) CG.NameValues.set(VarNames[i].first, OldBindings[i]);
+        else CG.NameValues.erase(VarNames[i].first);
+    }
+    return BodyVal;
+}
+
+Function* PrototypeAST::codegen(Compiler& CG) {
+    FunctionType* FT = getFunctionType(CG);
+    Function* F = 
+        Function::Create(FT, Function::ExternalLinkage, CG.Symbols.name(Name), CG.TheModule.get());
+
+    // set names for all arguements. Distinct bufs are assumed not to overlap,
+    // which lets loops over them be vectorized.
+    unsigned Idx = 0;
+    for (unsigned i = 0, e = Args.size(); i != e; i++) {
+        StringRef ArgName = CG.Symbols.name(Args[i]);
+        if (ArgTypes[i] == ValType::Buf) {
+            F->addParamAttr(Idx, Attribute::NoAlias);
+            F->getArg(Idx++)->setName(ArgName);
+            F->getArg(Idx++)->setName(ArgName + ".len");
+        } else {
+            F->getArg(Idx++)->setName(ArgName);
+        }
+    }
+    return F;
+}
+
+Function* FunctionAST::codegen(Compiler& CG) {
+    TimeReport::Scope CodegenTime(CG.Timers.get(), TimeReport::Codegen, CG.Symbols.name(Proto->getName()));
+    CG.NumCounters = 1;
+    CG.CallsImpure = CG.CallsDefinition = false;
+    // an arm dropped by folding still has to get through codegen, so the
+    // body as written is compiled first, for its errors only.
+    ExprAST* Unfolded = nullptr;
+    if (CG.Opts.Fold) {
+        ExprAST* Original = Body->clone(CG.ASTArena);
+        CG.DroppedArm = false;
+        simplify(CG);
+        if (CG.DroppedArm) Unfolded = Original;
+    }
+    // check if the func has been created with 'extern'
+    auto& P = *Proto;
+    CG.FunctionProtos.set(Proto->getName(), Proto->clone(CG.ProtoArena));
+    Function* TheFunction = CG.getFunction(P.getName());
+    if (!TheFunction) return nullptr;
+
+    // a batched module may already hold a body for this name.
+    if (!TheFunction->empty())
+        return (Function*)CG.LogErrorV("Function cannot be redefined.");
+    if (TheFunction->getFunctionType() != P.getFunctionType(CG))
+        return (Function*)CG.LogErrorV("Function redefined with different types.");
+
+    // perf walks the stack by frame pointer.
+    if (CG.Opts.PerfMap || CG.Opts.JITDump) TheFunction->addFnAttr("frame-pointer", "all");
+
+    // every floating point operation built from here on carries these flags.
+    FastMathFlags FMF;
+    if (Fast || CG.Opts.FastMath) FMF.setFast();
+    CG.Builder->setFastMathFlags(FMF);
+
+    if (Unfolded) {
+        bool Checked = codegenBody(CG, *TheFunction, *Unfolded);
+        TheFunction->deleteBody();
+        CG.NumCounters = 1;
+        if (!Checked) {
+            TheFunction->eraseFromParent();
+            return nullptr;
+        }
+    }
+
+    Value* RetVal = codegenBody(CG, *TheFunction, *Body);
+    // a cached result would skip the side effects.
+    if (RetVal && Memo && CG.CallsImpure) {
+        CG.LogError("memo functions cannot call externs that may have side effects");
+        RetVal = nullptr;
+    }
+    if (RetVal) {
+        CG.Builder->CreateRet(RetVal);
+        verifyFunction(*TheFunction);
+        if (CG.Profiling) CG.InstrumentFunction(*TheFunction);
+        CG.Impure.set(P.getName(), CG.CallsImpure);
+        // --memoize only picks functions that call something, as a table
+        // lookup costs more than a little arithmetic.
+        if (CG.Memoizing && P.isScalar() && CG.CallsDefinition && !CG.CallsImpure)
+            Memo = true;
+        CodegenTime.stop();
+        CG.TheFPM.run(*TheFunction, CG.TheFAM); // optimize the function
+        if (Memo) return CG.codegenMemoWrapper(*TheFunction);
+        return TheFunction;
+    }
+
+    // read body wrong, remove fuction
+    TheFunction->eraseFromParent();
+    return nullptr;
+}
+
+Value* FunctionAST::codegenBody(Compiler& CG, Function& F, ExprAST& E) {
+    auto& P = *Proto;
+    Function* TheFunction = &F;
+
+    // create a new BB to start insertion into
+    BasicBlock* BB = BasicBlock::Create(*CG.TheContext, "entry", TheFunction);
+    CG.Builder->SetInsertPoint(BB);
+    if (CG.Profiling) CG.emitCount(0);
+
+    // store each argument in an alloca and record it in the NameValues map,
+    // pairing up the pointer and length of each buf.
+    CG.NameValues.clear();
+    unsigned Idx = 0;
+    for (unsigned i = 0, e = P.getArgs().size(); i != e; i++) {
+        StringRef ArgName = CG.Symbols.name(P.getArgs()[i]);
+        Value* V = TheFunction->getArg(Idx++);
+        if (P.getArgTypes()[i] == ValType::Buf) {
+            V = CG.Builder->CreateInsertValue(UndefValue::get(CG.getLLVMType(ValType::Buf)), V, 0);
+            V = CG.Builder->CreateInsertValue(V, TheFunction->getArg(Idx++), 1);
+        }
+        AllocaInst* Alloca = CreateEntryBlockAlloca(TheFunction, V->getType(), ArgName);
+        CG.Builder->CreateStore(V, Alloca);
+        CG.NameValues.set(P.getArgs()[i], Alloca);
+    }
+
+    Value* RetVal = E.codegen(CG);
+    if (RetVal && !(RetVal = CG.coerce(RetVal, TheFunction->getReturnType())))
+        CG.LogError("Function body does not match its return type");
+    return RetVal;
+}
+
+
+
+/****** AST simplification ******/
+/* Run on each item before codegen, so that folded constants and dead if arms
+ * never reach the IR. Folding computes in doubles as the IR would: '<' is
+ * true for unordered operands (fcmp ult) and a condition is true when it is
+ * ordered and not 0.0 (fcmp one). */
+static const unsigned EvalStepLimit = 10000;
+static const unsigned EvalDepthLimit = 100;
+
+static bool foldBinop(char Op, double L, double R, double& V) {
+    switch (Op) {
+        case '+': V = L + R; return true;
+        case '-': V = L - R; return true;
+        case '*': V = L * R; return true;
+        case '<': V = !(L >= R) ? 1.0 : 0.0; return true;
+        default: return false;
+    }
+}
+
+static bool isTrue(double V) { return V < 0.0 || V > 0.0; }
+
+static SymbolID getBuiltinID(Builtin BI) { return array_lengthof(Keywords) + BI; }
+
+void FunctionAST::simplify(Compiler& CG) {
+    CG.SimplifyTypes.clear();
+    for (unsigned i = 0, e = Proto->getArgs().size(); i != e; i++)
+        CG.SimplifyTypes.set(Proto->getArgs()[i], Proto->getArgTypes()[i]);
+    ValType T;
+    Body = Body->simplify(CG, T);
+}
+
+ExprAST* NumberExprAST::simplify(Compiler& CG, ValType& T) {
+    T = ValType::Num;
+    return this;
+}
+
+ExprAST* VariableExprAST::simplify(Compiler& CG, ValType& T) {
+    T = CG.SimplifyTypes.lookup(Name);
+    return this;
+}
+
+ExprAST* BinaryExprAST::simplify(Compiler& CG, ValType& T) {
+    ValType LT, RT;
+    LHS = LHS->simplify(CG, LT);
+    RHS = RHS->simplify(CG, RT);
+    T = RT == ValType::Vec ? RT : LT;
+    double L, R, V;
+    if (LHS->getConstant(L) && RHS->getConstant(R) && foldBinop(Op, L, R, V))
+        return CG.make<NumberExprAST>(V);
+    return this;
+}
+
+ExprAST* CallExprAST::simplify(Compiler& CG, ValType& T) {
+    SmallVector<ExprAST*, 4> NewArgs;
+    SmallVector<double, 4> Vals;
+    for (ExprAST* Arg : Args) {
+        ValType AT;
+        NewArgs.push_back(Arg->simplify(CG, AT));
+        double V;
+        if (NewArgs.back()->getConstant(V)) Vals.push_back(V);
+    }
+    Args = copyArray<ExprAST*>(CG.ASTArena, NewArgs);
+
+    Builtin BI = getBuiltin(Callee);
+    if (BI != BI_None) {
+        T = BI == BI_Splat || BI == BI_Insert ? ValType::Vec : ValType::Num;
+        return this;
+    }
+    PrototypeAST* P = CG.FunctionProtos.lookup(Callee);
+    T = P ? P->getRetType() : ValType::Num;
+    double V;
+    if (P && Vals.size() == Args.size() && CG.foldCall(*this, *P, Vals, V))
+        return CG.make<NumberExprAST>(V);
+    return this;
+}
+
+ExprAST* AssignExprAST::simplify(Compiler& CG, ValType& T) {
+    ValType VT;
+    Value = Value->simplify(CG, VT);
+    T = CG.SimplifyTypes.lookup(Name);
+    return this;
+}
+
+ExprAST* IndexExprAST::simplify(Compiler& CG, ValType& T) {
+    ValType IT;
+    Index = Index->simplify(CG, IT);
+    if (Value) Value = Value->simplify(CG, IT);
+    T = ValType::Num;
+    return this;
+}
+
+ExprAST* IfExprAST::simplify(Compiler& CG, ValType& T) {
+    ValType CT, TT, ET;
+    Cond = Cond->simplify(CG, CT);
+    Then = Then->simplify(CG, TT);
+    Else = Else->simplify(CG, ET);
+    T = ET == ValType::Vec ? ET : TT;
+    double C;
+    if (!Cond->getConstant(C)) return this;
+
+    // keep the type the other arm gave the if: a number next to a vec is
+    // splat, and a buf next to anything else stays an error.
+    bool Taken = isTrue(C);
+    ExprAST* Live = Taken ? Then : Else;
+    ValType LiveT = Taken ? TT : ET;
+    bool Splat = LiveT == ValType::Num && T == ValType::Vec;
+    if (TT != ET && !(LiveT == ValType::Vec && (TT == ValType::Num || ET == ValType::Num)) &&
+        !Splat)
+        return this;
+    CG.DroppedArm = true;
+    if (!Splat) return Live;
+    return CG.make<CallExprAST>(getBuiltinID(BI_Splat), copyArray<ExprAST*>(CG.ASTArena, Live));
+}
+
+ExprAST* ForExprAST::simplify(Compiler& CG, ValType& T) {
+    ValType IT;
+    Start = Start->simplify(CG, IT);
+    ValType OldT = CG.SimplifyTypes.lookup(VarName);
+    CG.SimplifyTypes.set(VarName, ValType::Num);
+    Body = Body->simplify(CG, IT);
+    if (Step) Step = Step->simplify(CG, IT);
+    End = End->simplify(CG, IT);
+    CG.SimplifyTypes.set(VarName, OldT);
+    T = ValType::Num;
+    return this;
+}
+
+ExprAST* VarExprAST::simplify(Compiler& CG, ValType& T) {
+    SmallVector<std::pair<SymbolID, ExprAST*>, 4> NewVars;
+    SmallVector<ValType, 4> OldTypes;
+    for (auto& Var : VarNames) {
+        ValType IT = ValType::Num;
+        ExprAST* Init = Var.second ? Var.second->simplify(CG, IT) : nullptr;
+        NewVars.push_back({Var.first, Init});
+        OldTypes.push_back(CG.SimplifyTypes.lookup(Var.first));
+        CG.SimplifyTypes.set(Var.first, IT);
+    }
+    VarNames = copyArray<std::pair<SymbolID, ExprAST*>>(CG.ASTArena, NewVars);
+    Body = Body->simplify(CG, T);
+    for (unsigned i = VarNames.size(); i-- != 0;)
+        CG.SimplifyTypes.set(VarNames[i].first, OldTypes[i]);
+    return this;
+}
+
+// keep a copy of a small, pure definition to evaluate calls through. The JIT
+// refuses a second definition of a name, so the first one is kept.
+void Compiler::RetainFoldBody(const FunctionAST& FnAST) {
+    const PrototypeAST& P = FnAST.getProto();
+    if (!P.isScalar() || Impure.lookup(P.getName()) || FoldBodies.lookup(P.getName())) return;
+    if (FnAST.getBody()->size() > Opts.FoldCallLimit) return;
+    FoldBodies.set(P.getName(), FnAST.clone(FoldArena));
+}
+
+bool Compiler::foldCall(const ExprAST& Call, const PrototypeAST& Callee, ArrayRef<double> Args, double& V) {
+    // codegen checks the call against the latest prototype, which a rejected
+    // redefinition may have changed from that of the body kept.
+    FunctionAST* F = FoldBodies.lookup(Callee.getName());
+    if (!F || Args.size() != Callee.getArgs().size()) return false;
+    const PrototypeAST& Kept = F->getProto();
+    if (Kept.getArgTypes() != Callee.getArgTypes() || Kept.getRetType() != Callee.getRetType())
+        return false;
+    SmallString<64> Key;
+    Call.appendKey(Key);
+    auto R = FoldedCalls.try_emplace(Key);
+    if (R.second) {
+        EvalSteps = EvalStepLimit;
+        double Result = 0.0;
+        bool OK = evalCall(Callee.getName(), Args, Result);
+        R.first->second = {OK, Result};
+    }
+    V = R.first->second.second;
+    return R.first->second.first;
+}
+
+bool Compiler::evalCall(SymbolID Callee, ArrayRef<double> Args, double& V) {
+    FunctionAST* F = FoldBodies.lookup(Callee);
+    if (!F || F->getProto().getArgs().size() != Args.size()) return false;
+    if (!EvalSteps || EvalDepth == EvalDepthLimit) return false;
+    --EvalSteps;
+    ++EvalDepth;
+    size_t OldFrame = EvalFrame;
+    EvalFrame = EvalVars.size();
+    for (unsigned i = 0, e = Args.size(); i != e; i++)
+        EvalVars.push_back({F->getProto().getArgs()[i], Args[i]});
+    bool OK = F->getBody()->eval(*this, V);
+    // a failure anywhere below leaves its bindings behind.
+    EvalVars.resize(EvalFrame);
+    EvalFrame = OldFrame;
+    --EvalDepth;
+    return OK;
+}
+
+double* Compiler::lookupEvalVar(SymbolID Name) {
+    for (size_t i = EvalVars.size(); i-- > EvalFrame;)
+        if (EvalVars[i].first == Name) return &EvalVars[i].second;
+    return nullptr;
+}
+
+bool NumberExprAST::eval(Compiler& CG, double& V) const {
+    V = Val;
+    return true;
+}
+
+bool VariableExprAST::eval(Compiler& CG, double& V) const {
+    double* Slot = CG.lookupEvalVar(Name);
+    if (!Slot) return false;
+    V = *Slot;
+    return true;
+}
+
+bool BinaryExprAST::eval(Compiler& CG, double& V) const {
+    double L, R;
+    return LHS->eval(CG, L) && RHS->eval(CG, R) && foldBinop(Op, L, R, V);
+}
+
+bool CallExprAST::eval(Compiler& CG, double& V) const {
+    if (getBuiltin(Callee) != BI_None) return false;
+    SmallVector<double, 4> Vals;
+    for (ExprAST* Arg : Args) {
+        double A;
+        if (!Arg->eval(CG, A)) return false;
+        Vals.push_back(A);
+    }
+    return CG.evalCall(Callee, Vals, V);
+}
+
+bool AssignExprAST::eval(Compiler& CG, double& V) const {
+    if (!Value->eval(CG, V)) return false;
+    double* Slot = CG.lookupEvalVar(Name);
+    if (!Slot) return false;
+    *Slot = V;
+    return true;
+}
+
+bool IndexExprAST::eval(Compiler& CG, double& V) const {
+    return false;
+}
+
+bool IfExprAST::eval(Compiler& CG, double& V) const {
+    double C;
+    if (!Cond->eval(CG, C)) return false;
+    return (isTrue(C) ? Then : Else)->eval(CG, V);
+}
+
+bool ForExprAST::eval(Compiler& CG, double& V) const {
+    double StartV;
+    if (!Start->eval(CG, StartV)) return false;
+    size_t Slot = CG.EvalVars.size();
+    CG.EvalVars.push_back({VarName, StartV});
+    for (;;) {
+        if (!CG.EvalSteps) return false;
+        --CG.EvalSteps;
+        double BodyV, StepV = 1.0, EndV;
+        if (!Body->eval(CG, BodyV)) return false;
+        if (Step && !Step->eval(CG, StepV)) return false;
+        if (!End->eval(CG, EndV)) return false;
+        CG.EvalVars[Slot].second += StepV;
+        if (!isTrue(EndV)) break;
+    }
+    CG.EvalVars.resize(Slot);
+    V = 0.0;
+    return true;
+}
+
+bool VarExprAST::eval(Compiler& CG, double& V) const {
+    size_t Slot = CG.EvalVars.size();
+    for (auto& Var : VarNames) {
+        double Init = 0.0;
+        if (Var.second && !Var.second->eval(CG, Init)) return false;
+        CG.EvalVars.push_back({Var.first, Init});
+    }
+    if (!Body->eval(CG, V)) return false;
+    CG.EvalVars.resize(Slot);
+    return true;
+}
+
+
+
+/****** Bytecode lowering ******/
+int NumberExprAST::lower(Compiler& CG, zlang::bc::Builder& B) {
+    unsigned D = B.alloc();
+    B.emit(zlang::bc::LoadK, D, B.addConst(Val));
+    return D;
+}
+
+int VariableExprAST::lower(Compiler& CG, zlang::bc::Builder& B) {
+    return B.lookup(Name);
+}
+
+int BinaryExprAST::lower(Compiler& CG, zlang::bc::Builder& B) {
+    unsigned Top = B.getTop();
+    int L = LHS->lower(CG, B);
+    if (L < 0) return -1;
+    size_t RStart = B.here();
+    int R = RHS->lower(CG, B);
+    if (R < 0) return -1;
+    // L may be a variable's register; leave "x + (x = 1)" to the JIT.
+    if (B.writes(RStart, L)) return -1;
+
+    zlang::bc::Opcode Opc;
+    switch (Op) {
+        case '+': Opc = zlang::bc::Add; break;
+        case '-': Opc = zlang::bc::Sub; break;
+        case '*': Opc = zlang::bc::Mul; break;
+        case '<': Opc = zlang::bc::CmpLT; break;
+        default: return -1;
+    }
+    // operands are read before the result is written, so it may reuse them.
+    B.setTop(Top);
+    unsigned D = B.alloc();
+    B.emit(Opc, D, L, R);
+    return D;
+}
+
+int CallExprAST::lower(Compiler& CG, zlang::bc::Builder& B) {
+    // builtins and functions taking or returning vecs are never registered.
+    unsigned Idx = CG.BCFunctions.lookup(Callee);
+    if (!Idx) return -1;
+    zlang::bc::Function& CalleeF = CG.TheInterp->getFunction(Idx - 1);
+    if (!CalleeF.HasBody && !zlang::bc::Interpreter::canCallNatively(Args.size()))
+        return -1;
+
+    // arguments go in consecutive registers starting at Base.
+    unsigned Top = B.getTop();
+    for (unsigned i = 0, e = Args.size(); i != e; i++) B.alloc();
+    for (unsigned i = 0, e = Args.size(); i != e; i++) {
+        unsigned ArgTop = B.getTop();
+        int R = Args[i]->lower(CG, B);
+        if (R < 0) return -1;
+        if (unsigned(R) != Top + i) B.emit(zlang::bc::Move, Top + i, R);
+        B.setTop(ArgTop);
+    }
+    B.setTop(Top);
+    unsigned D = B.alloc();
+    B.emit(zlang::bc::Call, D, Top, Idx - 1);
+    return D;
+}
+
+int AssignExprAST::lower(Compiler& CG, zlang::bc::Builder& B) {
+    int R = Value->lower(CG, B);
+    if (R < 0) return -1;
+    int V = B.lookup(Name);
+    if (V < 0) return -1;
+    if (R != V) B.emit(zlang::bc::Move, V, R);
+    return V;
+}
+
+int IndexExprAST::lower(Compiler& CG, zlang::bc::Builder& B) {
+    // bufs only appear in functions that always run natively.
+    return -1;
+}
+
+int IfExprAST::lower(Compiler& CG, zlang::bc::Builder& B) {
+    unsigned D = B.alloc();
+    unsigned Top = B.getTop();
+
+    int C = Cond->lower(CG, B);
+    if (C < 0) return -1;
+    size_t ToElse = B.emit(zlang::bc::JumpIfFalse, C);
+    B.setTop(Top);
+
+    int T = Then->lower(CG, B);
+    if (T < 0) return -1;
+    if (unsigned(T) != D) B.emit(zlang::bc::Move, D, T);
+    B.setTop(Top);
+    size_t ToEnd = B.emit(zlang::bc::Jump, 0);
+
+    B.patch(ToElse, B.here());
+    int E = Else->lower(CG, B);
+    if (E < 0) return -1;
+    if (unsigned(E) != D) B.emit(zlang::bc::Move, D, E);
+    B.setTop(Top);
+
+    B.patch(ToEnd, B.here());
+    return D;
+}
+
+// same evaluation order as ForExprAST::codegen(): body, step, next value,
+// then the end condition, which still sees the current value.
+int ForExprAST::lower(Compiler& CG, zlang::bc::Builder& B) {
+    unsigned Outer = B.getTop();
+    int S = Start->lower(CG, B);
+    if (S < 0) return -1;
+    B.setTop(Outer);
+    unsigned V = B.alloc();
+    if (unsigned(S) != V) B.emit(zlang::bc::Move, V, S);
+
+    unsigned OldVal = B.bind(VarName, V);
+    unsigned Top = B.getTop();
+    size_t Loop = B.here();
+
+    if (Body->lower(CG, B) < 0) return -1;
+    B.setTop(Top);
+
+    int St;
+    if (Step) {
+        St = Step->lower(CG, B);
+        if (St < 0) return -1;
+    } else {
+        St = B.alloc();
+        B.emit(zlang::bc::LoadK, St, B.addConst(1.0));
+    }
+
+    size_t EndStart = B.here();
+    int EndCond = End->lower(CG, B);
+    if (EndCond < 0) return -1;
+    if (B.writes(EndStart, St)) return -1;
+    if (unsigned(EndCond) == V) {
+        EndCond = B.alloc();
+        B.emit(zlang::bc::Move, EndCond, V);
+    }
+    B.emit(zlang::bc::Add, V, V, St);
+    B.emit(zlang::bc::JumpIfTrue, EndCond, Loop);
+
+    B.restore(VarName, OldVal);
+    B.setTop(Outer);
+
+    // for expr always returns 0.0.
+    unsigned D = B.alloc();
+    B.emit(zlang::bc::LoadK, D, B.addConst(0.0));
+    return D;
+}
+
+int VarExprAST::lower(Compiler& CG, zlang::bc::Builder& B) {
+    // the result gets its own register below the variables, which are
+    // released afterwards.
+    unsigned D = B.alloc();
+    SmallVector<unsigned, 4> OldBindings;
+    for (auto& Var : VarNames) {
+        unsigned Top = B.getTop();
+        int R;
+        if (Var.second) {
+            R = Var.second->lower(CG, B);
+            if (R < 0) return -1;
+        } else {
+            R = B.alloc();
+            B.emit(zlang::bc::LoadK, R, B.addConst(0.0));
+        }
+        B.setTop(Top);
+        unsigned V = B.alloc();
+        if (unsigned(R) != V) B.emit(zlang::bc::Move, V, R);
+        OldBindings.push_back(B.bind(Var.first, V));
+    }
+
+    int R = Body->lower(CG, B);
+    if (R < 0) return -1;
+    B.emit(zlang::bc::Move, D, R);
+
+    for (unsigned i = VarNames.size(); i-- != 0;)
+        B.restore(VarNames[i].first, OldBindings[i]);
+    B.setTop(D + 1);
+    return D;
+}
+
+bool FunctionAST::lower(Compiler& CG, zlang::bc::Function& F) {
+    zlang::bc::Builder B(F);
+    for (SymbolID Arg : Proto->getArgs()) B.bind(Arg, B.alloc());
+    int R = Body->lower(CG, B);
+    if (R < 0) return false;
+    // Instr::A only holds 16 bits; bigger functions run natively.
+    if (F.NumRegs > UINT16_MAX) return false;
+    B.emit(zlang::bc::Ret, R);
+    B.markTailCalls();
+    return true;
+}
+
+// give the interpreter an entry for Proto and make calls to its name use it.
+zlang::bc::Function& Compiler::AddBytecodeFunction(const PrototypeAST& Proto) {
+    auto F = std::make_unique<zlang::bc::Function>();
+    F->Name = Symbols.name(Proto.getName()).str();
+    F->NumParams = Proto.getArgs().size();
+    zlang::bc::Function& Ref = *F;
+    BCFunctions.set(Proto.getName(), TheInterp->addFunction(std::move(F)) + 1);
+    return Ref;
+}
+
+void Compiler::LowerDefinition(FunctionAST& FnAST) {
+    if (!FnAST.getProto().isScalar()) return;
+    TimeReport::Scope LowerTime(Timers.get(), TimeReport::Lower, Symbols.name(FnAST.getProto().getName()));
+    // registered first so that recursive calls resolve to it.
+    SymbolID Name = FnAST.getProto().getName();
+    PendingLowered.emplace_back(Name, BCFunctions.lookup(Name));
+    zlang::bc::Function& F = AddBytecodeFunction(FnAST.getProto());
+    F.HasBody = true;
+    if (FnAST.lower(*this, F)) return;
+    // the IR compiled fine, so just always run this one natively.
+    F.Code.clear();
+    F.HasBody = false;
+}
+
+/****** top-level parsing and JIT driver ******/
+void Compiler::InitializeModuleAndPassManager() {
+    // open a new context and module
+    TheContext = std::make_unique<LLVMContext>();
+    
+    TheModule  = std::make_unique<Module>("my toy jit", *TheContext);
+    if (TheJIT) {
+        TheModule->setDataLayout(TheJIT->getDataLayout());
+    } else {
+        TheModule->setTargetTriple(TheTargetMachine->getTargetTriple().str());
+        TheModule->setDataLayout(TheTargetMachine->createDataLayout());
+    }
+    
+    Builder    = std::make_unique<IRBuilder<>>(*TheContext);
+
+    // cached analyses belong to the module just handed to the JIT.
+    TheFAM.clear();
+    TheMAM.clear();
+}
+
+// set up the per-function pipeline for the selected -O level. Heavier,
+// module-level optimization happens in the JIT as each module is compiled.
+void Compiler::InitializePassManager() {
+    PassBuilder PB(nullptr, PipelineTuningOptions(), None, Timers ? &ThePIC : nullptr);
+    PB.registerModuleAnalyses(TheMAM);
+    PB.registerCGSCCAnalyses(TheCGAM);
+    PB.registerFunctionAnalyses(TheFAM);
+    PB.registerLoopAnalyses(TheLAM);
+    PB.crossRegisterProxies(TheLAM, TheFAM, TheCGAM, TheMAM);
+
+    // self-recursive calls in tail position become loops at every level, so
+    // that recursion used for iteration runs in constant stack space.
+    TheFPM.addPass(TailCallElimPass());
+
+    if (Opts.OptLevel == 0) return;
+    // promote allocas to registers.
+    TheFPM.addPass(PromotePass());
+    // peephole optimization
+    TheFPM.addPass(InstCombinePass());
+    // reassociate expressions
+    TheFPM.addPass(ReassociatePass());
+    // eliminate common subexpressions.
+    TheFPM.addPass(GVNPass());
+    // simplify the control flow graph (deleting unreachable blocks, etc).
+    TheFPM.addPass(SimplifyCFGPass());
+}
+
+Error Compiler::FlushPendingDefinitions() {
+    if (!PendingDefs) return Error::success();
+    // calls to a profiled definition, even from this module, go through a
+    // stub that Reoptimize() can repoint. the body is compiled as name.tier0.
+    for (const std::string& Name : PendingProfiled) {
+        Function* F = TheModule->getFunction(Name);
+        F->setName(Name + ".tier0");
+        Function* Stub = Function::Create(F->getFunctionType(), Function::ExternalLinkage,
+                                          Name, TheModule.get());
+        F->replaceAllUsesWith(Stub);
+    }
+    // the counters and hooks are addresses in this process.
+    if (!PendingProfiled.empty()) zlang::DiskObjectCache::markUncached(*TheModule);
+    // a definition is only dumped once it is compiled, which folded calls or
+    // --lazy may put off for good, so dumped ones are compiled right away.
+    std::vector<std::string> Dumped;
+    if (IROut || AsmOut)
+        for (Function& F : *TheModule)
+            if (!F.hasLocalLinkage() && isDumped(F)) Dumped.push_back(F.getName().str());
+    ThreadSafeModule TSM(std::move(TheModule), std::move(TheContext));
+    Error Err = Dumped.empty() ? TheJIT->addModule(std::move(TSM))
+                               : TheJIT->addEagerModule(std::move(TSM));
+    for (const std::string& Name : PendingProfiled)
+        if (!Err) Err = TheJIT->addRedirectableSymbol(Name, Name + ".tier0");
+    PendingProfiled.clear();
+    for (const std::string& Name : Dumped) {
+        if (Err) break;
+        auto Sym = TheJIT->lookup(Name);
+        if (!Sym) failed(Sym.takeError());
+    }
+    // a rejected module's definitions must not live on in the interpreter.
+    if (Err) {
+        for (auto& P : reverse(PendingLowered)) {
+            zlang::bc::Function& F = TheInterp->getFunction(BCFunctions.lookup(P.first) - 1);
+            F.Code.clear();
+            F.HasBody = false;
+            if (P.second) BCFunctions.set(P.first, P.second);
+            else BCFunctions.erase(P.first);
+        }
+    }
+    PendingLowered.clear();
+    InitializeModuleAndPassManager();
+    PendingDefs = 0;
+    return Err;
+}
+
+void Compiler::HandleDefinition() {
+    TimeReport::Scope ParseTime(Timers.get(), TimeReport::Parse);
+    auto FnAST = ParseDefinition();
+    if (FnAST) ParseTime.setName(Symbols.name(FnAST->getProto().getName()));
+    ParseTime.stop();
+    if (FnAST) {
+        ItemLine = ItemStart;
+        // the lazy call-through behind the stubs only keeps the low half of
+        // vector argument registers.
+        // the stubs would bypass a memo table; profiling wins over --memoize.
+        Profiling = Opts.Reoptimize && TheJIT && !FnAST->getProto().takesVec() &&
+                    !FnAST->isMemo();
+        Memoizing = Opts.Memoize && !Profiling;
+        auto* FnIR = FnAST->codegen(*this);
+        if (FnIR && Profiling) PendingProfiled.push_back(FnIR->getName().str());
+        Profiling = Memoizing = false;
+        if (FnIR) {
+            if (Opts.Echo) {
+                fprintf(stderr, "Parsed a function definition: ");
+                FnIR->print(errs());
+                fprintf(stderr, "\n");
+            }
+            ++PendingDefs;
+            // a memo wrapper refers to its table and body, which are internal.
+            if (TheJIT && Opts.ImportLimit && !FnAST->isMemo()) SaveInlineBody(*FnIR);
+            if (Opts.Fold && Opts.FoldCallLimit) RetainFoldBody(*FnAST);
+            if (TheInterp) LowerDefinition(*FnAST);
+            // when compiling ahead of time everything stays in one module.
+            if (TheJIT && Opts.BatchSize && PendingDefs >= Opts.BatchSize)
+                failed(FlushPendingDefinitions());
+        }
+    } else getNextToken();  // Skip token for error recovery.
+}
+
+void Compiler::HandleExtern() {
+    TimeReport::Scope ParseTime(Timers.get(), TimeReport::Parse);
+    auto ProtoAST = ParseExtern();
+    if (ProtoAST) ParseTime.setName(Symbols.name(ProtoAST->getName()));
+    ParseTime.stop();
+    if (ProtoAST) {
+        ItemLine = ItemStart;
+        if (auto *FnIR = ProtoAST->codegen(*this)) {
+            if (Opts.Echo) {
+                fprintf(stderr, "Parsed an extern: ");
+                FnIR->print(errs());
+                fprintf(stderr, "\n");
+            }
+            // a definition keeps what its body was found to call.
+            if (!FunctionProtos.lookup(ProtoAST->getName()))
+                Impure.set(ProtoAST->getName(),
+                           !ProtoAST->isScalar() ||
+                               !isPureLibraryFunction(Symbols.name(ProtoAST->getName())));
+            FunctionProtos.set(ProtoAST->getName(), ProtoAST->clone(ProtoArena));
+            if (TheInterp && ProtoAST->isScalar()) AddBytecodeFunction(*ProtoAST);
+        }
+    } else getNextToken();
+}
+
+void Compiler::EvictCachedExpr() {
+    auto I = ExprCache.find(ExprCacheOrder.front());
+    ExprCacheOrder.pop_front();
+    failed(TheJIT->removeModule(I->second.RT));
+    ExprCache.erase(I);
+}
+
+void Compiler::HandleTopLevelExpression() {
+  // Evaluate a top-level expression into an anonymous function.
+  TimeReport::Scope ParseTime(Timers.get(), TimeReport::Parse, "__anon_expr");
+  auto FnAST = ParseTopLevelExpr();
+  ParseTime.stop();
+  if (FnAST) {
+        ItemLine = ItemStart;
+        if (!TheJIT) {
+            LogError("top-level expressions are not evaluated ahead of time");
+            return;
+        }
+        // the expression may call batched definitions, and its module is
+        // removed after evaluation, so they have to be compiled on their own.
+        failed(FlushPendingDefinitions());
+
+        if (TheInterp) {
+            // codegen checks the expression; anything the interpreter cannot
+            // run then takes the JIT path below.
+            Function* FnIR = FnAST->codegen(*this);
+            if (!FnIR) return;
+            // drop the analyses TheFPM cached for it along with the function.
+            TheFAM.clear(*FnIR, FnIR->getName());
+            FnIR->eraseFromParent();
+
+            zlang::bc::Function F;
+            F.Name = "__anon_expr";
+            F.HasBody = true;
+            if (FnAST->lower(*this, F)) {
+                double Result = TheInterp->evaluate(F);
+                if (const zlang::bc::Function* U = TheInterp->getUnresolved()) {
+                    LogError(("unresolved symbol " + U->Name).c_str());
+                    return;
+                }
+                if (Opts.Echo) fprintf(stderr, "Evaluated to %f\n", Result);
+                return;
+            }
+        }
+
+        SmallString<64> Key;
+        if (Opts.ExprCacheSize) {
+            FnAST->getBody()->appendKey(Key);
+            auto I = ExprCache.find(Key);
+            if (I != ExprCache.end()) {
+                double Result = I->second.FP();
+                if (Opts.Echo) fprintf(stderr, "Evaluated to %f\n", Result);
+                return;
+            }
+        }
+
+        if (auto* FnIR = FnAST->codegen(*this)) {
+            // cached expressions stay in the JIT, so each needs its own name.
+            std::string Name = "__anon_expr";
+            if (Opts.ExprCacheSize) {
+                Name += "." + std::to_string(ExprCounter++);
+                FnIR->setName(Name);
+            }
+            
+            if (Opts.Echo) {
+                fprintf(stderr, "Parsed a top-level expr: ");
+                FnIR->print(errs());
+            }
+            // create a ResourceTracker to track JIT'd memory a
+            auto RT  = TheJIT->getMainJITDylib().createResourceTracker();
+            auto TSM = ThreadSafeModule(std::move(TheModule), std::move(TheContext));
+            Error AddErr = TheJIT->addEagerModule(std::move(TSM), RT);
+          
+            InitializeModuleAndPassManager();
+            if (failed(std::move(AddErr))) return;
+
+            // search the JIT for the __anon_expr symbol.
+            auto ExprSymbol = TheJIT->lookup(Name);
+            if (!ExprSymbol) {
+                failed(ExprSymbol.takeError());
+                failed(TheJIT->removeModule(RT));
+                return;
+            }
+
+            // get the symbol's address and cast it to the right type
+            double(*FP)() = (double(*)())(intptr_t)ExprSymbol->getAddress();
+           
+            double Result = FP();
+            if (Opts.Echo) fprintf(stderr, "Evaluated to %f\n", Result);
+
+            if (Opts.ExprCacheSize) {
+                if (ExprCache.size() >= Opts.ExprCacheSize) EvictCachedExpr();
+                auto R = ExprCache.try_emplace(Key, CachedExpr{FP, RT});
+                ExprCacheOrder.push_back(R.first->getKey());
+                return;
+            }
+
+            // delete the anonymous expression module from the JIT
+            failed(TheJIT->removeModule(RT));
+        }
+  } else getNextToken();
+}
+
+// top ::= definition | external | expression | ';'
+void Compiler::MainLoop() {
+    while (true) {
+        if (Opts.Echo) fprintf(stderr, "ready> ");
+        ItemStart = TokLine;
+        ItemLine = 0;
+        switch (CurTok) {
+            case tok_eof: return;
+            case ';':
+                getNextToken();
+                break;
+            case tok_def:
+                HandleDefinition();
+                break;
+            case tok_extern:
+                HandleExtern();
+                break;
+            default: 
+                HandleTopLevelExpression();
+                break;
+        }
+        ReportJITErrors();
+        // release the AST of the item just handled.
+        ASTArena.Reset();
+    }
+}
+
+Error Compiler::initialize() {
+    InstallKeywords();
+    if (Error Err = InitializeDumps()) return Err;
+
+    if (Opts.AheadOfTime) {
+        if (Error Err = InitializeTargetMachine()) return Err;
+    } else {
+        KaleidoscopeJITOptions JITOpts;
+        JITOpts.Lazy = Opts.Lazy;
+        JITOpts.NumThreads = Opts.NumThreads;
+        JITOpts.OptLevel = Opts.OptLevel;
+        JITOpts.FastMath = Opts.FastMath;
+        JITOpts.CPU = Opts.CPU;
+        JITOpts.Features = Opts.Features;
+        JITOpts.CacheDir = Opts.CacheDir;
+        JITOpts.CacheSizeLimit = Opts.CacheSizeLimit;
+        JITOpts.Timers = Timers.get();
+        JITOpts.PerfMap = Opts.PerfMap;
+        JITOpts.JITDump = Opts.JITDump;
+        JITOpts.GDBRegistration = Opts.GDBRegistration;
+        JITOpts.ReportError = [this](Error Err) {
+            std::lock_guard<std::mutex> Lock(JITErrorsMutex);
+            JITErrors.push_back(toString(std::move(Err)));
+        };
+        if (IROut || AsmOut)
+            JITOpts.NotifyOptimized = [this](Module& M, TargetMachine& TM) { dumpModule(M, TM); };
+        auto JIT = KaleidoscopeJIT::Create(JITOpts);
+        if (!JIT) return JIT.takeError();
+        TheJIT = std::move(*JIT);
+    }
+    InitializePassManager();
+    InitializeModuleAndPassManager();
+
+    if (Opts.Reoptimize && TheJIT)
+        ReoptThread = std::make_unique<ThreadPool>(hardware_concurrency(1));
+
+    if (Opts.Interpret && TheJIT) {
+        // every definition is also handed to the JIT and flushed before any
+        // bytecode runs, so a hot function can always be looked up.
+        TheInterp = std::make_unique<zlang::bc::Interpreter>(
+            Opts.HotThreshold, [this](zlang::bc::Function& F) -> void* {
+                auto Sym = TheJIT->lookup(F.Name);
+                if (!Sym) {
+                    // keep interpreting it.
+                    failed(Sym.takeError());
+                    return nullptr;
+                }
+                return (void*)(intptr_t)Sym->getAddress();
+            });
+    }
+    return Error::success();
+}
+
+Error Compiler::run(std::unique_ptr<zlang::SourceBuffer> S) {
+    Source = std::move(S);
+    Diagnostics.clear();
+    CurLine = TokLine = 1;
+    ItemLine = 0;
+
+    if (Opts.Echo) fprintf(stderr, "ready> ");
+    getNextToken();
+    MainLoop();
+
+    // show what is still waiting to be handed to the JIT.
+    if (Opts.Echo && TheJIT) TheModule->print(errs(), nullptr);
+    Source.reset();
+    ReportJITErrors();
+
+    if (Diagnostics.empty()) return Error::success();
+    return make_error<zlang::DiagnosticError>(std::move(Diagnostics));
+}
+
+/****** --emit-ir and --emit-asm ******/
+Error Compiler::InitializeDumps() {
+    auto Open = [](const std::string& Path, std::unique_ptr<raw_fd_ostream>& OS) -> Error {
+        if (Path.empty()) return Error::success();
+        std::error_code EC;
+        OS = std::make_unique<raw_fd_ostream>(Path, EC, sys::fs::OF_Text);
+        if (EC) return createFileError(Path, EC);
+        return Error::success();
+    };
+    if (Error Err = Open(Opts.EmitIR, IROut)) return Err;
+    if (Error Err = Open(Opts.EmitAsm, AsmOut)) return Err;
+    for (const std::string& Name : Opts.EmitFunctions) DumpFunctions.insert(Name);
+    return Error::success();
+}
+
+bool Compiler::isDumped(const Function& F) const {
+    // imported bodies are only there to be inlined. a name is matched up to
+    // any '.', so that f also picks out f.tier0 and f.compute.
+    return !F.isDeclaration() && !F.hasAvailableExternallyLinkage() &&
+           (DumpFunctions.empty() || DumpFunctions.count(F.getName().split('.').first));
+}
+
+// write what M defines, as it is about to be compiled, to the dumps.
+void Compiler::dumpModule(Module& M, TargetMachine& TM) {
+    auto Wanted = [&](const Function& F) { return isDumped(F); };
+    if (none_of(M, Wanted)) return;
+
+    std::lock_guard<std::mutex> Lock(DumpMutex);
+    if (IROut) {
+        for (Function& F : M)
+            if (Wanted(F)) F.print(*IROut);
+        IROut->flush();
+    }
+    if (AsmOut) {
+        // codegen rewrites the IR it is given, so work on a copy that only
+        // keeps the bodies asked for.
+        std::unique_ptr<Module> Copy = CloneModule(M);
+        for (Function& F : *Copy)
+            if (!F.isDeclaration() && !Wanted(F)) F.deleteBody();
+        legacy::PassManager PM;
+        if (!TM.addPassesToEmitFile(PM, *AsmOut, nullptr, CGFT_AssemblyFile))
+            PM.run(*Copy);
+        AsmOut->flush();
+    }
+}
+
+/****** profile-guided reoptimization ******/
+/* With Opts.Reoptimize every definition starts out with counters on its
+ * entry, loop iterations and if arms. Codegen emits them as calls to the
+ * marker zlang.count(i32 counter); InstrumentFunction() saves the function
+ * with its markers and then lowers them to increments. Counter 0 counts calls
+ * and iterations together, and the increment that takes it to
+ * ReoptThreshold asks for the function to be reoptimized.
+ *
+ * Reoptimize() then rebuilds the function from the saved copy on its own
+ * thread: the markers become branch weights, the bodies of profiled callees
+ * are brought in for the inliner, and the module goes through the -O3
+ * pipeline. Calls reach every profiled function through a stub, which is
+ * finally pointed at the new code. Calls already running finish in the old
+ * code. The counters are updated without synchronization, so counts from
+ * several threads are approximate. */
+
+// called from JIT'd code once the function P gets hot.
+static void RequestReoptimize(void* P) {
+    auto& F = *static_cast<Compiler::ProfiledFunction*>(P);
+    if (F.Scheduled.exchange(true)) return;
+    F.CG->ReoptThread->async([&F] { F.CG->Reoptimize(F); });
+}
+
+void Compiler::emitCount(unsigned Counter) {
+    FunctionCallee Marker = TheModule->getOrInsertFunction(
+        "zlang.count", Builder->getVoidTy(), Builder->getInt32Ty());
+    Builder->CreateCall(Marker, Builder->getInt32(Counter));
+}
+
+// tag Br with the counters of its two successors. a loop's Taken counts
+// iterations and NotTaken the times it was entered.
+void Compiler::profileBranch(BranchInst* Br, StringRef Kind, unsigned Taken, unsigned NotTaken) {
+    Metadata* Ops[] = {
+        MDString::get(*TheContext, Kind),
+        ConstantAsMetadata::get(Builder->getInt32(Taken)),
+        ConstantAsMetadata::get(Builder->getInt32(NotTaken))};
+    Br->setMetadata("zlang.branch", MDNode::get(*TheContext, Ops));
+}
+
+void Compiler::InstrumentFunction(Function& F) {
+    ProfiledFunctions.emplace_back();
+    ProfiledFunction& P = ProfiledFunctions.back();
+    P.CG = this;
+    P.Name = F.getName().str();
+    P.Bitcode = SnapshotFunction(F, Function::ExternalLinkage);
+    P.Counters.reset(new uint64_t[NumCounters]());
+    {
+        std::lock_guard<std::mutex> Lock(ProfiledMutex);
+        ProfiledByName[P.Name] = &P;
+    }
+
+    Type* I64 = Builder->getInt64Ty();
+    FunctionType* HookTy = FunctionType::get(Builder->getVoidTy(), {Builder->getInt8PtrTy()}, false);
+    Function* Marker = TheModule->getFunction("zlang.count");
+    for (User* U : make_early_inc_range(Marker->users())) {
+        auto* Call = cast<CallInst>(U);
+        uint64_t Counter = cast<ConstantInt>(Call->getArgOperand(0))->getZExtValue();
+        IRBuilder<> B(Call);
+        Value* Ptr = B.CreateIntToPtr(B.getInt64((uintptr_t)&P.Counters[Counter]), I64->getPointerTo());
+        Value* N = B.CreateAdd(B.CreateLoad(I64, Ptr), B.getInt64(1));
+        B.CreateStore(N, Ptr);
+        if (Counter == 0) {
+            Value* Hot = B.CreateICmpEQ(N, B.getInt64(Opts.ReoptThreshold));
+            Instruction* Then = SplitBlockAndInsertIfThen(
+                Hot, Call, /*Unreachable=*/false, MDBuilder(*TheContext).createBranchWeights(1, 1 << 20));
+            B.SetInsertPoint(Then);
+            B.CreateCall(HookTy, B.CreateIntToPtr(B.getInt64((uintptr_t)&RequestReoptimize), HookTy->getPointerTo()),
+                         B.CreateIntToPtr(B.getInt64((uintptr_t)&P), B.getInt8PtrTy()));
+        }
+        Call->eraseFromParent();
+    }
+    Marker->eraseFromParent();
+    for (BasicBlock& BB : F) BB.getTerminator()->setMetadata("zlang.branch", nullptr);
+}
+
+// turn the counts behind F's markers into branch weights and drop the markers.
+static void ApplyProfile(Function& F, const uint64_t* Counters) {
+    LLVMContext& Ctx = F.getContext();
+    unsigned BranchKind = Ctx.getMDKindID("zlang.branch");
+    MDBuilder MDB(Ctx);
+    for (BasicBlock& BB : F) {
+        Instruction* Br = BB.getTerminator();
+        MDNode* MD = Br->getMetadata(BranchKind);
+        if (!MD) continue;
+        Br->setMetadata(BranchKind, nullptr);
+        auto Count = [&](unsigned Op) {
+            return Counters[mdconst::extract<ConstantInt>(MD->getOperand(Op))->getZExtValue()];
+        };
+        uint64_t Taken = Count(1), NotTaken = Count(2);
+        // a loop branches back once per iteration, bar the last.
+        if (cast<MDString>(MD->getOperand(0))->getString() == "loop")
+            Taken = Taken > NotTaken ? Taken - NotTaken : 0;
+        if (!Taken && !NotTaken) continue;
+        while (Taken > UINT32_MAX || NotTaken > UINT32_MAX) {
+            Taken >>= 1;
+            NotTaken >>= 1;
+        }
+        Br->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(Taken, NotTaken));
+    }
+    for (Instruction& I : make_early_inc_range(instructions(F)))
+        if (auto* Call = dyn_cast<CallInst>(&I))
+            if (Call->getCalledFunction() && Call->getCalledFunction()->getName() == "zlang.count")
+                Call->eraseFromParent();
+}
+
+// recompile P as P.tier1 and point its stub there. runs on ReoptThread, so
+// only touches the JIT and what ProfiledMutex guards.
+void Compiler::Reoptimize(ProfiledFunction& P) {
+    auto Ctx = std::make_unique<LLVMContext>();
+    auto Load = [&](const ProfiledFunction& Src) -> std::unique_ptr<Module> {
+        auto M = parseBitcodeFile(MemoryBufferRef(Src.Bitcode, Src.Name), *Ctx);
+        if (!M) {
+            consumeError(M.takeError());
+            return nullptr;
+        }
+        ApplyProfile(*(*M)->getFunction(Src.Name), Src.Counters.get());
+        return std::move(*M);
+    };
+    std::unique_ptr<Module> M = Load(P);
+    if (!M) return;
+    // recursive calls stay within the new code.
+    std::string Name = P.Name + ".tier1";
+    M->getFunction(P.Name)->setName(Name);
+
+    SmallVector<ProfiledFunction*, 4> Callees;
+    {
+        std::lock_guard<std::mutex> Lock(ProfiledMutex);
+        for (Function& F : *M)
+            if (F.isDeclaration())
+                if (ProfiledFunction* Callee = ProfiledByName.lookup(F.getName()))
+                    Callees.push_back(Callee);
+    }
+    for (ProfiledFunction* Callee : Callees) {
+        std::unique_ptr<Module> CM = Load(*Callee);
+        if (!CM) continue;
+        CM->getFunction(Callee->Name)->setLinkage(Function::AvailableExternallyLinkage);
+        if (Linker::linkModules(*M, std::move(CM))) return;
+    }
+    if (Function* Marker = M->getFunction("zlang.count")) Marker->eraseFromParent();
+
+    // inline the callees far more eagerly than -O3 does (threshold 250).
+    for (Instruction& I : instructions(*M->getFunction(Name)))
+        if (auto* CB = dyn_cast<CallBase>(&I))
+            if (CB->getCalledFunction() && CB->getCalledFunction()->hasAvailableExternallyLinkage())
+                CB->addFnAttr(Attribute::get(M->getContext(), "call-threshold-bonus", "750"));
+
+    Error Err = TheJIT->addModuleAtO3(ThreadSafeModule(std::move(M), std::move(Ctx)), PipelineTuningOptions());
+    if (!Err) {
+        auto Sym = TheJIT->lookup(Name);
+        if (Sym) Err = TheJIT->redirect(P.Name, Sym->getAddress());
+        else Err = Sym.takeError();
+    }
+    // the function keeps running its first version.
+    if (Err && Opts.Echo) logAllUnhandledErrors(std::move(Err), errs(), "reoptimizing " + P.Name + ": ");
+    else consumeError(std::move(Err));
+}
+
+/****** calls from the host ******/
+Expected<uint64_t> Compiler::lookupFunction(StringRef Name, StringRef Signature) {
+    if (!TheJIT)
+        return createStringError(inconvertibleErrorCode(),
+                                 "nothing is run when compiling ahead of time");
+    PrototypeAST* P = FunctionProtos.lookup(Symbols.intern(Name));
+    if (!P)
+        return createStringError(inconvertibleErrorCode(), "unknown function '%s'",
+                                 Name.str().c_str());
+
+    // a vec has no C parameter type, so it never matches.
+    std::string Sig;
+    for (ValType T : P->getArgTypes())
+        Sig += T == ValType::Num ? "d" : T == ValType::Buf ? "pi" : "v";
+    if (P->getRetType() != ValType::Num || Sig != Signature)
+        return createStringError(inconvertibleErrorCode(),
+                                 "'%s' does not have the requested type",
+                                 Name.str().c_str());
+
+    if (Error Err = FlushPendingDefinitions()) return std::move(Err);
+    auto Sym = TheJIT->lookup(Name);
+    if (!Sym) return withJITErrors(Sym.takeError());
+    return Sym->getAddress();
+}
+
+/* Build a loop that calls the function over packed argument tuples:
+ *   void name.batch(double* args, double* results, i64 count)
+ * where tuple i is args[i*n .. i*n+n-1] for n parameters. The callee's saved
+ * body is imported when there is one, so at -O2 it can be inlined into the
+ * loop and the whole loop vectorized. */
+Function* Compiler::codegenBatchWrapper(SymbolID Name) {
+    // Name has a prototype, so this at least declares it.
+    Function* F = getFunction(Name);
+    unsigned NumParams = F->arg_size();
+
+    Type* D = Builder->getDoubleTy();
+    Type* I64 = Builder->getInt64Ty();
+    FunctionType* FT = FunctionType::get(Builder->getVoidTy(),
+                                         {D->getPointerTo(), D->getPointerTo(), I64}, false);
+    Function* W = Function::Create(FT, Function::ExternalLinkage,
+                                   Symbols.name(Name) + ".batch", TheModule.get());
+    if (Opts.PerfMap || Opts.JITDump) W->addFnAttr("frame-pointer", "all");
+    W->addParamAttr(0, Attribute::NoAlias);
+    W->addParamAttr(0, Attribute::ReadOnly);
+    W->addParamAttr(1, Attribute::NoAlias);
+    Value* Args = W->getArg(0);
+    Value* Results = W->getArg(1);
+    Value* Count = W->getArg(2);
+    Args->setName("args");
+    Results->setName("results");
+    Count->setName("count");
+
+    BasicBlock* Entry = BasicBlock::Create(*TheContext, "entry", W);
+    BasicBlock* LoopBB = BasicBlock::Create(*TheContext, "loop", W);
+    BasicBlock* AfterBB = BasicBlock::Create(*TheContext, "afterloop", W);
+    Builder->SetInsertPoint(Entry);
+    Builder->setFastMathFlags(FastMathFlags());
+    Builder->CreateCondBr(Builder->CreateICmpEQ(Count, Builder->getInt64(0)), AfterBB, LoopBB);
+
+    Builder->SetInsertPoint(LoopBB);
+    PHINode* I = Builder->CreatePHI(I64, 2, "i");
+    I->addIncoming(Builder->getInt64(0), Entry);
+    Value* Base = Builder->CreateMul(I, Builder->getInt64(NumParams), "base", true, true);
+    SmallVector<Value*, 8> CallArgs;
+    for (unsigned i = 0; i != NumParams; i++) {
+        Value* Idx = Builder->CreateAdd(Base, Builder->getInt64(i), "idx", true, true);
+        Value* Ptr = Builder->CreateInBoundsGEP(D, Args, Idx, "arg");
+        CallArgs.push_back(Builder->CreateAlignedLoad(D, Ptr, Align(8), "load"));
+    }
+    Value* R = Builder->CreateCall(F, CallArgs, "calltmp");
+    Builder->CreateAlignedStore(R, Builder->CreateInBoundsGEP(D, Results, I, "result"), Align(8));
+    Value* Next = Builder->CreateAdd(I, Builder->getInt64(1), "next", true, true);
+    I->addIncoming(Next, LoopBB);
+    Builder->CreateCondBr(Builder->CreateICmpEQ(Next, Count), AfterBB, LoopBB);
+
+    Builder->SetInsertPoint(AfterBB);
+    Builder->CreateRetVoid();
+    verifyFunction(*W);
+    return W;
+}
+
+/* Route every call to Compute, including its own recursive ones, through a
+ * wrapper that looks the arguments up in a table of Opts.MemoTableSize recent
+ * results. The table is split into sets of two entries, picked by a hash of
+ * the argument bits; an entry holds the hash (0 when empty), the argument
+ * bits and the result, and is a hit only if they all match. A miss computes
+ * the result and stores it in the first entry of its set, moving the one
+ * there to the second, so each set keeps its two newest results. The table
+ * is a zeroed global in the module, so memory stays bounded and it is not
+ * synchronized: memo functions must not run on two threads at once. */
+Function* Compiler::codegenMemoWrapper(Function& Compute) {
+    std::string Name = Compute.getName().str();
+    Compute.setName(Name + ".compute");
+    Compute.setLinkage(Function::InternalLinkage);
+    Function* W = Function::Create(Compute.getFunctionType(), Function::ExternalLinkage,
+                                   Name, TheModule.get());
+    Compute.replaceAllUsesWith(W);
+    if (Opts.PerfMap || Opts.JITDump) W->addFnAttr("frame-pointer", "all");
+    for (unsigned i = 0, e = W->arg_size(); i != e; i++)
+        W->getArg(i)->setName(Compute.getArg(i)->getName());
+
+    unsigned NumArgs = W->arg_size();
+    unsigned NumSets = Opts.MemoTableSize / 2;
+    Type* D = Builder->getDoubleTy();
+    Type* I64 = Builder->getInt64Ty();
+    StructType* EntryTy = StructType::get(*TheContext, {I64, ArrayType::get(I64, NumArgs), D});
+    ArrayType* TableTy = ArrayType::get(ArrayType::get(EntryTy, 2), NumSets);
+    auto* Table = new GlobalVariable(*TheModule, TableTy, false, GlobalValue::InternalLinkage,
+                                     ConstantAggregateZero::get(TableTy), Name + ".memo");
+    Table->setAlignment(Align(64));
+
+    BasicBlock* Entry = BasicBlock::Create(*TheContext, "entry", W);
+    BasicBlock* Way1BB = BasicBlock::Create(*TheContext, "way1", W);
+    BasicBlock* HitBB = BasicBlock::Create(*TheContext, "hit", W);
+    BasicBlock* MissBB = BasicBlock::Create(*TheContext, "miss", W);
+    Builder->SetInsertPoint(Entry);
+    Builder->setFastMathFlags(FastMathFlags());
+
+    // multiply-xor hash; the high bits depend on every argument bit.
+    const uint64_t K = 0x9E3779B97F4A7C15ULL;
+    SmallVector<Value*, 8> Bits, Args;
+    Value* H = Builder->getInt64(K);
+    for (Argument& A : W->args()) {
+        Args.push_back(&A);
+        Bits.push_back(Builder->CreateBitCast(&A, I64, A.getName() + ".bits"));
+        H = Builder->CreateMul(Builder->CreateXor(H, Bits.back()), Builder->getInt64(K), "hash");
+    }
+    Value* Set = NumSets > 1 ? Builder->CreateLShr(H, 64 - Log2_32(NumSets), "set")
+                             : Builder->getInt64(0);
+    Value* Tag = Builder->CreateOr(H, 1, "tag");
+
+    auto getEntry = [&](unsigned Way) {
+        return Builder->CreateInBoundsGEP(TableTy, Table,
+                                          {Builder->getInt64(0), Set, Builder->getInt64(Way)},
+                                          "way" + Twine(Way) + ".entry");
+    };
+    auto getField = [&](Value* E, unsigned Field, unsigned Index = 0) {
+        SmallVector<Value*, 3> Idx = {Builder->getInt32(0), Builder->getInt32(Field)};
+        if (Field == 1) Idx.push_back(Builder->getInt32(Index));
+        return Builder->CreateInBoundsGEP(EntryTy, E, Idx);
+    };
+
+    // compare every field, branch free: an entry is at most a cache line or two.
+    PHINode* Hit = nullptr;
+    for (unsigned Way = 0; Way != 2; Way++) {
+        if (Way) Builder->SetInsertPoint(Way1BB);
+        Value* E = getEntry(Way);
+        Value* Match = Builder->CreateICmpEQ(Builder->CreateLoad(I64, getField(E, 0)), Tag);
+        for (unsigned i = 0; i != NumArgs; i++)
+            Match = Builder->CreateAnd(
+                Match, Builder->CreateICmpEQ(Builder->CreateLoad(I64, getField(E, 1, i)), Bits[i]));
+        Value* R = Builder->CreateLoad(D, getField(E, 2), "cached");
+        BasicBlock* From = Builder->GetInsertBlock();
+        Builder->CreateCondBr(Match, HitBB, Way ? MissBB : Way1BB);
+        if (!Way) {
+            Builder->SetInsertPoint(HitBB);
+            Hit = Builder->CreatePHI(D, 2, "result");
+        }
+        Hit->addIncoming(R, From);
+    }
+    Builder->SetInsertPoint(HitBB);
+    Builder->CreateRet(Hit);
+
+    // the call may have filled the set, so the entry to move is read after it.
+    Builder->SetInsertPoint(MissBB);
+    Value* R = Builder->CreateCall(&Compute, Args, "calltmp");
+    Value* E0 = getEntry(0);
+    Builder->CreateStore(Builder->CreateLoad(EntryTy, E0), getEntry(1));
+    Builder->CreateStore(Tag, getField(E0, 0));
+    for (unsigned i = 0; i != NumArgs; i++)
+        Builder->CreateStore(Bits[i], getField(E0, 1, i));
+    Builder->CreateStore(R, getField(E0, 2));
+    Builder->CreateRet(R);
+    verifyFunction(*W);
+    return W;
+}
+
+Expected<uint64_t> Compiler::lookupBatch(StringRef Name, unsigned NumParams) {
+    if (!TheJIT)
+        return createStringError(inconvertibleErrorCode(),
+                                 "nothing is run when compiling ahead of time");
+    SymbolID ID = Symbols.intern(Name);
+    PrototypeAST* P = FunctionProtos.lookup(ID);
+    if (!P)
+        return createStringError(inconvertibleErrorCode(), "unknown function '%s'",
+                                 Name.str().c_str());
+    if (!P->isScalar() || P->getArgs().size() != NumParams)
+        return createStringError(inconvertibleErrorCode(),
+                                 "'%s' does not have the requested type",
+                                 Name.str().c_str());
+
+    // one wrapper per function, built on first use.
+    auto I = BatchWrappers.find(Name);
+    if (I != BatchWrappers.end()) return I->second;
+
+    // the wrapper goes in a module of its own, as definitions do.
+    if (Error Err = FlushPendingDefinitions()) return std::move(Err);
+    Function* W = codegenBatchWrapper(ID);
+    std::string WrapperName = W->getName().str();
+    ++PendingDefs;
+    if (Error Err = FlushPendingDefinitions()) return std::move(Err);
+
+    auto Sym = TheJIT->lookup(WrapperName);
+    if (!Sym) return withJITErrors(Sym.takeError());
+    BatchWrappers[Name] = Sym->getAddress();
+    return Sym->getAddress();
+}
+
+/****** ahead-of-time compilation ******/
+Error Compiler::InitializeTargetMachine() {
+    std::string TargetTriple = sys::getDefaultTargetTriple();
+    std::string Err;
+    auto Target = TargetRegistry::lookupTarget(TargetTriple, Err);
+    if (!Target) return createStringError(inconvertibleErrorCode(), Err);
+
+    unsigned Level = Opts.OptLevel;
+    CodeGenOpt::Level CGLevel = Level == 0 ? CodeGenOpt::None
+                              : Level == 1 ? CodeGenOpt::Less
+                              : Level == 2 ? CodeGenOpt::Default
+                                           : CodeGenOpt::Aggressive;
+    // objects are portable unless a CPU is asked for.
+    std::string CPU = Opts.CPU.empty() ? "generic" : Opts.CPU;
+    SubtargetFeatures Features;
+    if (CPU == "host") {
+        CPU = sys::getHostCPUName().str();
+        StringMap<bool> HostFeatures;
+        if (sys::getHostCPUFeatures(HostFeatures))
+            for (auto& F : HostFeatures) Features.AddFeature(F.first(), F.second);
+    }
+    SmallVector<StringRef, 8> ExtraFeatures;
+    StringRef(Opts.Features).split(ExtraFeatures, ',', -1, /*KeepEmpty=*/false);
+    for (StringRef F : ExtraFeatures) Features.AddFeature(F);
+
+    TargetOptions Options;
+    if (Opts.FastMath) Options.AllowFPOpFusion = FPOpFusion::Fast;
+    // position independent, so the object can also go into a shared library.
+    TheTargetMachine.reset(Target->createTargetMachine(
+        TargetTriple, CPU, Features.getString(), Options, Reloc::PIC_, None, CGLevel));
+    return Error::success();
+}
+
+// run the module pipeline for the -O level over TheModule and write it out
+// as a native object file.
+Error Compiler::writeObject(StringRef Path) {
+    if (!TheTargetMachine)
+        return createStringError(inconvertibleErrorCode(),
+                                 "objects are only written when compiling ahead of time");
+
+    unsigned Level = Opts.OptLevel;
+    if (Level > 0) {
+        LoopAnalysisManager LAM;
+        FunctionAnalysisManager FAM;
+        CGSCCAnalysisManager CGAM;
+        ModuleAnalysisManager MAM;
+
+        PipelineTuningOptions PTO;
+        PTO.LoopVectorization = Level >= 2;
+        PTO.SLPVectorization = Level >= 2;
+        PassBuilder PB(TheTargetMachine.get(), PTO, None, Timers ? &ThePIC : nullptr);
+        PB.registerModuleAnalyses(MAM);
+        PB.registerCGSCCAnalyses(CGAM);
+        PB.registerFunctionAnalyses(FAM);
+        PB.registerLoopAnalyses(LAM);
+        PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+        OptimizationLevel OL = Level == 1 ? OptimizationLevel::O1
+                             : Level == 2 ? OptimizationLevel::O2
+                                          : OptimizationLevel::O3;
+        PB.buildPerModuleDefaultPipeline(OL).run(*TheModule, MAM);
+    }
+    if (IROut || AsmOut) dumpModule(*TheModule, *TheTargetMachine);
+
+    std::error_code EC;
+    ToolOutputFile Out(Path, EC, sys::fs::OF_None);
+    if (EC) return createFileError(Path, EC);
+
+    legacy::PassManager PM;
+    if (TheTargetMachine->addPassesToEmitFile(PM, Out.os(), nullptr, CGFT_ObjectFile))
+        return createStringError(inconvertibleErrorCode(),
+                                 "TargetMachine can't emit a file of this type");
+    {
+        TimeReport::Scope EmitTime(Timers.get(), TimeReport::Emit, Path);
+        PM.run(*TheModule);
+    }
+    Out.keep();
+    return Error::success();
+}
+
+/****** libraries ******/
+/* A library holds each definition compiled ahead of time as a module of its
+ * own. Importing one registers the prototypes right away, and the JIT parses
+ * each module, straight from the mapped file, when its function is first
+ * looked up. */
+static bool usesLocalSymbol(const Function& F) {
+    for (const Instruction& I : instructions(F))
+        for (const Value* Op : I.operands())
+            if (auto* GV = dyn_cast<GlobalValue>(Op))
+                if (GV->hasLocalLinkage()) return true;
+    return false;
+}
+
+Error Compiler::writeLibrary(StringRef Path) {
+    if (!TheTargetMachine)
+        return createStringError(inconvertibleErrorCode(),
+                                 "libraries are only written when compiling ahead of time");
+
+    std::vector<LibraryFunction> Functions;
+    std::vector<std::string> Bitcode;
+    for (Function& F : *TheModule) {
+        if (F.isDeclaration() || !F.hasExternalLinkage()) continue;
+        PrototypeAST* P = FunctionProtos.lookup(Symbols.intern(F.getName()));
+        if (!P) continue;
+        LibraryFunction LF;
+        LF.Name = F.getName().str();
+        for (SymbolID Arg : P->getArgs()) LF.ArgNames.push_back(Symbols.name(Arg).str());
+        for (ValType T : P->getArgTypes()) LF.ArgTypes.push_back(uint8_t(T));
+        LF.RetType = uint8_t(P->getRetType());
+        if (!Impure.lookup(P->getName())) LF.Flags |= LibraryFunction::Pure;
+        if (!usesLocalSymbol(F)) LF.Flags |= LibraryFunction::Inlinable;
+        LF.NumInstructions = F.getInstructionCount();
+        Functions.push_back(std::move(LF));
+        Bitcode.push_back(SnapshotFunction(F, Function::ExternalLinkage));
+    }
+    for (size_t i = 0, e = Functions.size(); i != e; i++) Functions[i].Bitcode = Bitcode[i];
+    return Library::write(Path, Opts.VectorWidth, Functions);
+}
+
+Error Compiler::importLibrary(StringRef Path) {
+    auto Lib = Library::open(Path);
+    if (!Lib) return Lib.takeError();
+    if ((*Lib)->VectorWidth != Opts.VectorWidth)
+        return createStringError(inconvertibleErrorCode(),
+                                 "%s: compiled with a vector width of %u, not %u",
+                                 Path.str().c_str(), (*Lib)->VectorWidth, Opts.VectorWidth);
+
+    // check every function first, so that a library is imported whole or not at all.
+    for (const LibraryFunction& F : (*Lib)->Functions) {
+        auto Bad = [](uint8_t T) { return T > uint8_t(ValType::Buf); };
+        if (F.RetType > uint8_t(ValType::Vec) || any_of(F.ArgTypes, Bad))
+            return createStringError(inconvertibleErrorCode(), "%s: bad types for '%s'",
+                                     Path.str().c_str(), F.Name.c_str());
+        if (FunctionProtos.lookup(Symbols.intern(F.Name)))
+            return createStringError(inconvertibleErrorCode(), "%s: '%s' is already defined",
+                                     Path.str().c_str(), F.Name.c_str());
+    }
+
+    for (const LibraryFunction& F : (*Lib)->Functions) {
+        SymbolID Name = Symbols.intern(F.Name);
+        SmallVector<SymbolID, 4> Args;
+        for (const std::string& Arg : F.ArgNames) Args.push_back(Symbols.intern(Arg));
+        SmallVector<ValType, 4> ArgTypes;
+        for (uint8_t T : F.ArgTypes) ArgTypes.push_back(ValType(T));
+        auto* Proto = new (ProtoArena.Allocate<PrototypeAST>())
+            PrototypeAST(Name, copyArray<SymbolID>(ProtoArena, Args),
+                         copyArray<ValType>(ProtoArena, ArgTypes), ValType(F.RetType));
+        FunctionProtos.set(Name, Proto);
+        Impure.set(Name, !(F.Flags & LibraryFunction::Pure));
+        if (TheInterp && Proto->isScalar()) AddBytecodeFunction(*Proto);
+
+        // ahead of time, everything goes into the one module.
+        if (!TheJIT) {
+            auto M = parseBitcodeFile(MemoryBufferRef(F.Bitcode, F.Name), *TheContext);
+            if (!M) return M.takeError();
+            (*M)->setDataLayout(TheModule->getDataLayout());
+            if (Linker::linkModules(*TheModule, std::move(*M)))
+                return createStringError(inconvertibleErrorCode(), "%s: could not link '%s'",
+                                         Path.str().c_str(), F.Name.c_str());
+            continue;
+        }
+
+        if (Opts.ImportLimit && (F.Flags & LibraryFunction::Inlinable) &&
+            F.NumInstructions <= Opts.ImportLimit)
+            InlineBodies[F.Name] = F.Bitcode.str();
+        StringRef Bitcode = F.Bitcode;
+        std::string FnName = F.Name;
+        DataLayout DL = TheJIT->getDataLayout();
+        Error Err = TheJIT->addDeferredModule(F.Name, [Bitcode, FnName, DL]() -> Expected<ThreadSafeModule> {
+            auto Ctx = std::make_unique<LLVMContext>();
+            auto M = parseBitcodeFile(MemoryBufferRef(Bitcode, FnName), *Ctx);
+            if (!M) return M.takeError();
+            (*M)->setDataLayout(DL);
+            return ThreadSafeModule(std::move(*M), std::move(Ctx));
+        });
+        if (Err) return Err;
+    }
+    Libraries.push_back(std::move(*Lib));
+    return Error::success();
+}
+
+/****** Engine ******/
+char zlang::DiagnosticError::ID = 0;
+
+void zlang::DiagnosticError::log(raw_ostream& OS) const {
+    for (size_t i = 0, e = Diagnostics.size(); i != e; i++) {
+        if (i) OS << "\n";
+        OS << "line " << Diagnostics[i].Line << ": " << Diagnostics[i].Message;
+    }
+}
+
+zlang::Engine::Engine(std::unique_ptr<Compiler> C) : C(std::move(C)) {}
+
+zlang::Engine::~Engine() = default;
+
+Expected<std::unique_ptr<zlang::Engine>>
+zlang::Engine::Create(const EngineOptions& Opts) {
+    // the target registry is process-wide.
+    static std::once_flag TargetsInitialized;
+    std::call_once(TargetsInitialized, [] {
+        InitializeNativeTarget();
+        InitializeNativeTargetAsmPrinter();
+        InitializeNativeTargetAsmParser();
+    });
+
+    if (Opts.OptLevel > 3)
+        return createStringError(inconvertibleErrorCode(), "invalid optimization level");
+    if (Opts.VectorWidth < 2 || !isPowerOf2_32(Opts.VectorWidth))
+        return createStringError(inconvertibleErrorCode(),
+                                 "vector width must be a power of two");
+    if (Opts.MemoTableSize < 2 || !isPowerOf2_32(Opts.MemoTableSize))
+        return createStringError(inconvertibleErrorCode(),
+                                 "memo table size must be a power of two");
+
+    auto C = std::make_unique<Compiler>(Opts);
+    // only the JIT's -O2/-O3 module pipeline inlines.
+    if (Opts.OptLevel < 2) C->Opts.ImportLimit = 0;
+    // code inlined into callers would never be replaced.
+    if (Opts.Reoptimize) C->Opts.ImportLimit = 0;
+    if (Error Err = C->initialize()) return std::move(Err);
+    return std::unique_ptr<Engine>(new Engine(std::move(C)));
+}
+
+Error zlang::Engine::compile(StringRef Source) {
+    return C->run(SourceBuffer::CreateFromText(Source));
+}
+
+Error zlang::Engine::compileFile(StringRef Path) {
+    auto Source = SourceBuffer::Create(Path);
+    if (!Source) return Source.takeError();
+    return C->run(std::move(*Source));
+}
+
+Expected<uint64_t> zlang::Engine::lookupFunction(StringRef Name, StringRef Signature) {
+    return C->lookupFunction(Name, Signature);
+}
+
+Expected<uint64_t> zlang::Engine::lookupBatch(StringRef Name, unsigned NumParams) {
+    return C->lookupBatch(Name, NumParams);
+}
+
+Error zlang::Engine::writeObject(StringRef Path) {
+    return C->writeObject(Path);
+}
+
+Error zlang::Engine::importLibrary(StringRef Path) {
+    return C->importLibrary(Path);
+}
+
+Error zlang::Engine::writeLibrary(StringRef Path) {
+    return C->writeLibrary(Path);
+}
+
+void zlang::Engine::printTimeReport(raw_ostream& OS, TimeReportFormat Format) {
+    if (!C->Timers) return;
+    switch (Format) {
+        case TimeReportFormat::Text: C->Timers->printText(OS); break;
+        case TimeReportFormat::JSON: C->Timers->printJSON(OS); break;
+        case TimeReportFormat::ChromeTrace: C->Timers->printChromeTrace(OS); break;
+    }
+}
+
+/****** "Library" functions that can be "extern'd" from user code ******/
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+extern "C" DLLEXPORT double putchard(double X) {
+  fputc((char)X, stderr);
+  return 0;
+}
+
+extern "C" DLLEXPORT double printd(double X) {
+  fprintf(stderr, "%f\n", X);
+  return 0;
+}
+
+
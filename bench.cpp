@@ -0,0 +1,351 @@
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "include/Engine.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+/* zlang_bench runs a fixed set of generated workloads through the Engine API
+ * and reports their throughput, so that optimization tiers can be compared
+ * and regressions caught between releases. Every source is generated the same
+ * way each run; only --scale changes its size. */
+
+/****** command line ******/
+static cl::opt<char> OptLevel(
+    "O",
+    cl::desc("Optimization level. [-O0, -O1, -O2, or -O3] (default = '-O1')"),
+    cl::Prefix, cl::ZeroOrMore, cl::init('1'));
+
+static cl::opt<bool> LazyCompile(
+    "lazy",
+    cl::desc("Compile each function only when it is first called"));
+
+static cl::opt<unsigned> JITThreads(
+    "jit-threads",
+    cl::desc("Number of background threads used to compile modules"),
+    cl::init(0));
+
+static cl::opt<bool> Interpret(
+    "interpret",
+    cl::desc("Interpret functions until they are hot"));
+
+static cl::opt<bool> Reoptimize(
+    "reoptimize",
+    cl::desc("Recompile hot functions at -O3 using their profile"));
+
+static cl::opt<bool> NoFold(
+    "no-fold",
+    cl::desc("Do not fold constants in the AST before codegen"));
+
+static cl::opt<unsigned> Scale(
+    "scale",
+    cl::desc("Multiply the size of every workload by this"),
+    cl::init(1));
+
+static cl::opt<unsigned> Repeat(
+    "repeat",
+    cl::desc("Run each workload this many times, keeping the fastest"),
+    cl::init(3));
+
+static cl::list<std::string> Workloads(
+    "workloads",
+    cl::desc("Only run these workloads (parse, codegen, loops, fib, churn)"),
+    cl::value_desc("name,..."), cl::CommaSeparated);
+
+static cl::opt<bool> JSON(
+    "json",
+    cl::desc("Print the results as JSON, for comparing runs"));
+
+/****** measurement ******/
+using Clock = std::chrono::steady_clock;
+
+static double secondsSince(Clock::time_point Start) {
+    return std::chrono::duration<double>(Clock::now() - Start).count();
+}
+
+// the high-water mark of this process, or of the largest of its children
+// waited for, in KiB.
+static uint64_t peakRSS(int Who = RUSAGE_SELF) {
+    struct rusage RU;
+    getrusage(Who, &RU);
+    return RU.ru_maxrss;
+}
+
+struct Result {
+    std::string Name;
+    // what was counted in Count, such as "lines".
+    std::string Unit;
+    double Count = 0;
+    double Seconds = 0;
+    // seconds taken by each compile or lookup timed on its own, sorted.
+    std::vector<double> Latencies;
+    // the high-water mark of the process that ran every repeat, in KiB.
+    uint64_t PeakRSS = 0;
+
+    Result() = default;
+    Result(std::string Name, std::string Unit, double Count, double Seconds = 0)
+        : Name(std::move(Name)), Unit(std::move(Unit)), Count(Count), Seconds(Seconds) {}
+
+    double percentile(double P) const {
+        if (Latencies.empty()) return 0;
+        size_t I = std::min(Latencies.size() - 1, size_t(P / 100 * Latencies.size()));
+        return Latencies[I];
+    }
+};
+
+static ExitOnError ExitOnErr("zlang_bench: ");
+
+static std::unique_ptr<zlang::Engine> create(bool AheadOfTime = false) {
+    zlang::EngineOptions Opts;
+    Opts.OptLevel = OptLevel - '0';
+    Opts.Lazy = LazyCompile;
+    Opts.NumThreads = JITThreads;
+    Opts.Interpret = Interpret;
+    Opts.Reoptimize = Reoptimize;
+    Opts.Fold = !NoFold;
+    Opts.AheadOfTime = AheadOfTime;
+    return ExitOnErr(zlang::Engine::Create(Opts));
+}
+
+// compile Source, timing it into Latencies if given.
+static void compile(zlang::Engine& E, StringRef Source, std::vector<double>* Latencies = nullptr) {
+    Clock::time_point Start = Clock::now();
+    ExitOnErr(E.compile(Source));
+    if (Latencies) Latencies->push_back(secondsSince(Start));
+}
+
+/****** workloads ******/
+// Each workload builds a fresh engine, runs once and returns what it did.
+
+// lexing, parsing and IR generation of a large file, ahead of time so that
+// no machine code is generated.
+static Result runParse() {
+    unsigned N = 20000 * Scale;
+    std::string Src;
+    for (unsigned i = 0; i != N; i++) {
+        std::string I = std::to_string(i);
+        Src += "def p" + I + "(a b c) # definition " + I + "\n";
+        Src += "    if a < b then (a + " + I + ") * c - b else\n";
+        Src += "        for k = 0, k < c in a * " + I + ".5 + k;\n";
+    }
+    auto E = create(/*AheadOfTime=*/true);
+    Clock::time_point Start = Clock::now();
+    compile(*E, Src);
+    return Result("parse", "lines", 3 * N, secondsSince(Start));
+}
+
+// many small definitions, each compiled to machine code by looking it up and
+// calling it, as lazily compiled ones only are once called.
+static Result runCodegen() {
+    unsigned N = 2000 * Scale;
+    std::string Src;
+    for (unsigned i = 0; i != N; i++) {
+        std::string I = std::to_string(i);
+        Src += "def f" + I + "(x y) if x < y then x * " + I + " + y else y - x * " + I + ";\n";
+    }
+    auto E = create();
+    Result R("codegen", "functions", N);
+    Clock::time_point Start = Clock::now();
+    compile(*E, Src);
+    for (unsigned i = 0; i != N; i++) {
+        Clock::time_point LookupStart = Clock::now();
+        ExitOnErr(E->lookup<double(double, double)>("f" + std::to_string(i)))(1, 2);
+        R.Latencies.push_back(secondsSince(LookupStart));
+    }
+    R.Seconds = secondsSince(Start);
+    return R;
+}
+
+// nested for loops, counted by inner iteration.
+static Result runLoops() {
+    unsigned N = 2000 * Scale;
+    auto E = create();
+    compile(*E, "def loops(n) var s in (for i = 0, i < n in\n"
+                "    for j = 0, j < n in s = s + i * j - (s < 0)) + s;\n");
+    Clock::time_point Start = Clock::now();
+    compile(*E, "loops(" + std::to_string(N) + ");");
+    return Result("loops", "iterations", double(N) * N, secondsSince(Start));
+}
+
+// recursive calls.
+static Result runFib() {
+    unsigned N = 27 + (Scale > 1 ? 2 * Scale : 0);
+    auto E = create();
+    compile(*E, "def fib(n) if n < 2 then n else fib(n-1) + fib(n-2);");
+    Clock::time_point Start = Clock::now();
+    compile(*E, "fib(" + std::to_string(N) + ");");
+    // fib(n) makes 2 fib(n+1) - 1 calls.
+    double A = 0, B = 1;
+    for (unsigned i = 0; i != N + 1; i++) {
+        double C = A + B;
+        A = B;
+        B = C;
+    }
+    return Result("fib", "calls", 2 * A - 1, secondsSince(Start));
+}
+
+// distinct top-level expressions, each compiled and run on its own.
+static Result runChurn() {
+    unsigned N = 1000 * Scale;
+    auto E = create();
+    compile(*E, "def g(x y) if x < y then x * y else x + y;\n"
+                "extern sqrt(x);");
+    Result R("churn", "expressions", N);
+    Clock::time_point Start = Clock::now();
+    for (unsigned i = 0; i != N; i++) {
+        std::string I = std::to_string(i);
+        compile(*E, "g(sqrt(" + I + "), " + std::to_string(i % 17) + ") + " + I + ";", &R.Latencies);
+    }
+    R.Seconds = secondsSince(Start);
+    return R;
+}
+
+struct Workload {
+    const char* Name;
+    Result (*Run)();
+};
+
+static const Workload AllWorkloads[] = {
+    {"parse", runParse}, {"codegen", runCodegen}, {"loops", runLoops},
+    {"fib", runFib}, {"churn", runChurn},
+};
+
+// every repeat of W, keeping the fastest.
+static Result runRepeats(const Workload& W) {
+    Result Best;
+    std::vector<double> Latencies;
+    for (unsigned i = 0; i < std::max(1u, unsigned(Repeat)); i++) {
+        Result R = W.Run();
+        Latencies.insert(Latencies.end(), R.Latencies.begin(), R.Latencies.end());
+        if (!i || R.Seconds < Best.Seconds) Best = std::move(R);
+    }
+    // percentiles come from every run, not just the fastest.
+    Best.Latencies = std::move(Latencies);
+    llvm::sort(Best.Latencies);
+    return Best;
+}
+
+// runRepeats(W) in a child process, which sends back its result as JSON, so
+// that its peak RSS is not that of the workloads run before it.
+static Expected<Result> runIsolated(const Workload& W) {
+    int Pipe[2];
+    if (pipe(Pipe)) return errorCodeToError(std::error_code(errno, std::generic_category()));
+    pid_t Child = fork();
+    if (Child < 0) return errorCodeToError(std::error_code(errno, std::generic_category()));
+    if (!Child) {
+        close(Pipe[0]);
+        Result R = runRepeats(W);
+        raw_fd_ostream OS(Pipe[1], /*shouldClose=*/true);
+        OS << json::Value(json::Object{
+            {"name", R.Name}, {"unit", R.Unit}, {"count", R.Count},
+            {"seconds", R.Seconds}, {"latencies", json::Array(R.Latencies)},
+            {"peak_rss_kib", int64_t(peakRSS())}});
+        OS.close();
+        _exit(OS.has_error());
+    }
+
+    close(Pipe[1]);
+    std::string Out;
+    char Buf[4096];
+    for (ssize_t Len; (Len = read(Pipe[0], Buf, sizeof(Buf))) != 0;) {
+        if (Len > 0) Out.append(Buf, Len);
+        else if (errno != EINTR) break;
+    }
+    close(Pipe[0]);
+    int Status;
+    while (waitpid(Child, &Status, 0) < 0 && errno == EINTR) {}
+    if (!WIFEXITED(Status) || WEXITSTATUS(Status))
+        return createStringError(inconvertibleErrorCode(), "workload '%s' failed", W.Name);
+
+    Expected<json::Value> V = json::parse(Out);
+    if (!V) return V.takeError();
+    Result R;
+    int64_t PeakRSS = 0;
+    json::Path::Root Root(W.Name);
+    json::ObjectMapper O(*V, Root);
+    if (!O || !O.map("name", R.Name) || !O.map("unit", R.Unit) ||
+        !O.map("count", R.Count) || !O.map("seconds", R.Seconds) ||
+        !O.map("latencies", R.Latencies) || !O.map("peak_rss_kib", PeakRSS))
+        return Root.getError();
+    R.PeakRSS = PeakRSS;
+    return R;
+}
+
+/****** report ******/
+static void printText(ArrayRef<Result> Results) {
+    outs() << "workload        count unit          time (ms)     per second  peak KiB\n";
+    for (const Result& R : Results)
+        outs() << format("%-8s %12.0f %-12s %10.3f %14.0f %9llu\n", R.Name.c_str(), R.Count,
+                         R.Unit.c_str(), R.Seconds * 1e3, R.Count / R.Seconds,
+                         (unsigned long long)R.PeakRSS);
+    for (const Result& R : Results) {
+        if (R.Latencies.empty()) continue;
+        outs() << format("\n%s latency (ms): p50 %.3f  p90 %.3f  p99 %.3f  max %.3f",
+                         R.Name.c_str(), R.percentile(50) * 1e3, R.percentile(90) * 1e3,
+                         R.percentile(99) * 1e3, R.Latencies.back() * 1e3);
+    }
+    outs() << "\n\npeak RSS: " << std::max(peakRSS(), peakRSS(RUSAGE_CHILDREN)) << " KiB\n";
+}
+
+static void printJSON(ArrayRef<Result> Results) {
+    json::OStream J(outs(), 2);
+    J.object([&] {
+        J.attribute("opt_level", int64_t(OptLevel - '0'));
+        J.attribute("scale", int64_t(Scale));
+        J.attributeArray("workloads", [&] {
+            for (const Result& R : Results)
+                J.object([&] {
+                    J.attribute("name", R.Name);
+                    J.attribute("unit", R.Unit);
+                    J.attribute("count", R.Count);
+                    J.attribute("ms", R.Seconds * 1e3);
+                    J.attribute("per_second", R.Count / R.Seconds);
+                    J.attribute("peak_rss_kib", int64_t(R.PeakRSS));
+                    if (R.Latencies.empty()) return;
+                    J.attributeObject("latency_ms", [&] {
+                        J.attribute("p50", R.percentile(50) * 1e3);
+                        J.attribute("p90", R.percentile(90) * 1e3);
+                        J.attribute("p99", R.percentile(99) * 1e3);
+                        J.attribute("max", R.Latencies.back() * 1e3);
+                    });
+                });
+        });
+        J.attribute("peak_rss_kib", int64_t(std::max(peakRSS(), peakRSS(RUSAGE_CHILDREN))));
+    });
+    outs() << "\n";
+}
+
+int main(int argc, char** argv) {
+    cl::ParseCommandLineOptions(argc, argv, "zlang benchmarks\n");
+    if (OptLevel < '0' || OptLevel > '3') {
+        errs() << argv[0] << ": invalid optimization level.\n";
+        return 1;
+    }
+    for (const std::string& W : Workloads)
+        if (none_of(AllWorkloads, [&](const auto& A) { return W == A.Name; })) {
+            errs() << argv[0] << ": unknown workload '" << W << "'\n";
+            return 1;
+        }
+
+    std::vector<Result> Results;
+    for (const auto& W : AllWorkloads) {
+        if (!Workloads.empty() && !is_contained(Workloads, W.Name)) continue;
+        Results.push_back(ExitOnErr(runIsolated(W)));
+    }
+
+    if (JSON) printJSON(Results);
+    else printText(Results);
+    return 0;
+}
@@ -0,0 +1,283 @@
+//===- Engine.h - Embeddable zlang compiler and JIT -------------*- C++ -*-===//
+//
+// Contains the Engine, which owns everything needed to compile and run zlang
+// code: the symbol table, the module under construction, the JIT and the
+// bytecode interpreter. Engines share no state, so a process can run any
+// number of them on separate threads. A single engine must only be used by
+// one thread at a time.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef ZLANG_ENGINE_H
+#define ZLANG_ENGINE_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace zlang {
+
+class Compiler;
+
+struct EngineOptions {
+  // 0-3, as for -O.
+  unsigned OptLevel = 1;
+
+  // Definitions collected into one module before it is handed to the JIT;
+  // 0 collects them until the next top-level expression.
+  unsigned BatchSize = 1;
+
+  // JIT settings; see KaleidoscopeJITOptions.
+  bool Lazy = false;
+  unsigned NumThreads = 0;
+  std::string CPU;
+  std::string Features;
+  std::string CacheDir;
+  uint64_t CacheSizeLimit = 0;
+
+  // Compiled top-level expressions kept for reuse; 0 disables the cache.
+  unsigned ExprCacheSize = 256;
+
+  // Lanes in a vec; a power of two.
+  unsigned VectorWidth = 4;
+
+  // Largest function, in IR instructions, that later modules may inline; 0
+  // disables this. Only used from -O2 up.
+  unsigned ImportLimit = 50;
+
+  // Treat every function as 'def fast'.
+  bool FastMath = false;
+
+  // Run code in the bytecode interpreter until it has been called
+  // HotThreshold times.
+  bool Interpret = false;
+  unsigned HotThreshold = 100;
+
+  // Collect every definition into one module for writeObject() or
+  // writeLibrary() instead of running anything. CPU defaults to "generic"
+  // rather than the host.
+  bool AheadOfTime = false;
+
+  // Print REPL output to stderr: prompts, the IR of each item, the value of
+  // each top-level expression and diagnostics as they come up.
+  bool Echo = false;
+
+  // Files to write the IR and assembly of compiled functions to, as each
+  // module is handed to codegen (after the module pipeline); empty disables
+  // a dump. EmitFunctions limits both to the named functions. Definitions
+  // that are dumped are compiled as soon as they are defined, even if Lazy
+  // is set or every call to them was folded.
+  std::string EmitIR;
+  std::string EmitAsm;
+  std::vector<std::string> EmitFunctions;
+
+  // Time each phase of compilation, per function and per pass, for
+  // Engine::printTimeReport(). Lexing is timed per token, which slows it down.
+  bool TimeReport = false;
+
+  // Make JIT'd code visible to profilers and debuggers; see
+  // KaleidoscopeJITOptions. Either perf option also keeps frame pointers, so
+  // that call graphs can be unwound through zlang code.
+  bool PerfMap = false;
+  bool JITDump = false;
+  bool GDBRegistration = false;
+
+  // Count the calls, loop iterations and if arms taken in every definition
+  // that takes no vec.
+  // Once calls and iterations reach ReoptThreshold, the function is rebuilt
+  // in the background at -O3 with those branch weights and its callees
+  // inlined, and calls then go to the new code. Turns off ImportLimit.
+  bool Reoptimize = false;
+  unsigned ReoptThreshold = 10000;
+
+  // Treat every definition that only takes and returns numbers, calls
+  // another definition and has no side effects as 'def memo'. Reoptimize
+  // takes precedence for definitions not marked memo.
+  bool Memoize = false;
+  // Results kept by each memo function; a power of two. Memo functions must
+  // not be called from two threads at once.
+  unsigned MemoTableSize = 4096;
+
+  // Fold constants and if arms with constant conditions in the AST before
+  // codegen. A call whose arguments are all constants is replaced by its
+  // value when the callee is a definition of at most FoldCallLimit AST nodes
+  // that only uses numbers and has no side effects, and the value can be
+  // found within a fixed number of calls and loop iterations; 0 disables
+  // this.
+  bool Fold = true;
+  unsigned FoldCallLimit = 64;
+};
+
+enum class TimeReportFormat {
+  // Totals per phase and the functions and passes that took longest.
+  Text,
+  // All the totals, by phase and by name within each phase.
+  JSON,
+  // Every timed region, for chrome://tracing or Perfetto.
+  ChromeTrace
+};
+
+struct Diagnostic {
+  // 1-based line of the source: where a syntax error was found, or where the
+  // item starts for errors found once it has been parsed.
+  unsigned Line;
+  std::string Message;
+};
+
+// The diagnostics reported while compiling some source, in order.
+class DiagnosticError : public llvm::ErrorInfo<DiagnosticError> {
+public:
+  static char ID;
+
+  std::vector<Diagnostic> Diagnostics;
+
+  explicit DiagnosticError(std::vector<Diagnostic> Diagnostics)
+      : Diagnostics(std::move(Diagnostics)) {}
+
+  void log(llvm::raw_ostream &OS) const override;
+  std::error_code convertToErrorCode() const override {
+    return llvm::inconvertibleErrorCode();
+  }
+};
+
+namespace detail {
+
+// How each C parameter type is passed: a num is a double and a buf is a
+// pointer followed by a length.
+template <typename T> struct ParamCode;
+template <> struct ParamCode<double> { static constexpr char Value = 'd'; };
+template <> struct ParamCode<double *> { static constexpr char Value = 'p'; };
+template <> struct ParamCode<int64_t> { static constexpr char Value = 'i'; };
+
+template <typename FnT> struct Signature;
+template <typename... ArgTs> struct Signature<double(ArgTs...)> {
+  static std::string get() {
+    const char Codes[] = {ParamCode<ArgTs>::Value..., '\0'};
+    return Codes;
+  }
+};
+
+template <typename... Ts> struct AllDouble : std::true_type {};
+template <typename T, typename... Ts>
+struct AllDouble<T, Ts...>
+    : std::integral_constant<bool, std::is_same<T, double>::value &&
+                                       AllDouble<Ts...>::value> {};
+
+} // end namespace detail
+
+// A compiled function that only takes numbers, from Engine::getFunction().
+// Besides direct calls it can evaluate the function over many argument tuples
+// at once, in a loop compiled along with it.
+template <typename FnT> class FunctionHandle;
+
+template <typename... ArgTs> class FunctionHandle<double(ArgTs...)> {
+  static_assert(detail::AllDouble<ArgTs...>::value,
+                "a FunctionHandle only takes doubles; use Engine::lookup()");
+
+private:
+  friend class Engine;
+  double (*Fn)(ArgTs...) = nullptr;
+  void (*Batch)(const double *, double *, uint64_t) = nullptr;
+
+public:
+  static constexpr unsigned NumParams = sizeof...(ArgTs);
+
+  FunctionHandle() = default;
+  explicit operator bool() const { return Fn != nullptr; }
+
+  double operator()(ArgTs... Args) const { return Fn(Args...); }
+
+  // Set Results[i] to the function applied to the i-th of Count tuples in
+  // Args, each NumParams consecutive doubles. Args and Results must not
+  // overlap.
+  void batch(const double *Args, double *Results, uint64_t Count) const {
+    Batch(Args, Results, Count);
+  }
+};
+
+class Engine {
+private:
+  std::unique_ptr<Compiler> C;
+
+  explicit Engine(std::unique_ptr<Compiler> C);
+
+  // Return the address of Name, checking it against Signature (one
+  // detail::ParamCode per parameter).
+  llvm::Expected<uint64_t> lookupFunction(llvm::StringRef Name,
+                                          llvm::StringRef Signature);
+
+  // Return the address of the batch loop for Name, building it on first use.
+  llvm::Expected<uint64_t> lookupBatch(llvm::StringRef Name,
+                                       unsigned NumParams);
+
+public:
+  Engine(const Engine &) = delete;
+  Engine &operator=(const Engine &) = delete;
+  ~Engine();
+
+  static llvm::Expected<std::unique_ptr<Engine>>
+  Create(const EngineOptions &Opts = EngineOptions());
+
+  // Compile every item in Source and run its top-level expressions. Items
+  // with errors are skipped; their diagnostics come back as a
+  // DiagnosticError once the whole source has been handled.
+  llvm::Error compile(llvm::StringRef Source);
+
+  // As compile(), reading the named file, or stdin if Path is "-".
+  llvm::Error compileFile(llvm::StringRef Path);
+
+  // Return a pointer to the compiled function Name, such as
+  // lookup<double(double, double)>("add"). A buf parameter is passed as a
+  // double * and an int64_t. Not available with AheadOfTime.
+  template <typename FnT> llvm::Expected<FnT *> lookup(llvm::StringRef Name) {
+    auto Addr = lookupFunction(Name, detail::Signature<FnT>::get());
+    if (!Addr)
+      return Addr.takeError();
+    return reinterpret_cast<FnT *>(static_cast<uintptr_t>(*Addr));
+  }
+
+  // Return a handle to the compiled function Name, which must only take and
+  // return numbers, such as getFunction<double(double, double)>("add").
+  template <typename FnT>
+  llvm::Expected<FunctionHandle<FnT>> getFunction(llvm::StringRef Name) {
+    FunctionHandle<FnT> H;
+    auto Fn = lookup<FnT>(Name);
+    if (!Fn)
+      return Fn.takeError();
+    auto Batch = lookupBatch(Name, FunctionHandle<FnT>::NumParams);
+    if (!Batch)
+      return Batch.takeError();
+    H.Fn = *Fn;
+    H.Batch = reinterpret_cast<decltype(H.Batch)>(
+        static_cast<uintptr_t>(*Batch));
+    return H;
+  }
+
+  // Optimize everything compiled so far and write it out as an object file.
+  // Only available with AheadOfTime.
+  llvm::Error writeObject(llvm::StringRef Path);
+
+  // Write every definition compiled so far to a library for importLibrary().
+  // Only available with AheadOfTime, and then instead of writeObject().
+  llvm::Error writeLibrary(llvm::StringRef Path);
+
+  // Make the definitions in a library from writeLibrary() callable from
+  // code compiled after this. The file is mapped, and each definition is
+  // only compiled once it is first called; ahead of time, they are all added
+  // to the object. The library must have been written with the same
+  // VectorWidth and must not define anything already defined.
+  llvm::Error importLibrary(llvm::StringRef Path);
+
+  // Write out the time spent so far in each phase. Does nothing unless
+  // EngineOptions::TimeReport was set.
+  void printTimeReport(llvm::raw_ostream &OS,
+                       TimeReportFormat Format = TimeReportFormat::Text);
+};
+
+} // end namespace zlang
+
+#endif // ZLANG_ENGINE_H
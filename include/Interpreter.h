@@ -0,0 +1,334 @@
+//===- Interpreter.h - Bytecode tier for zlang ------------------*- C++ -*-===//
+//
+// Contains a compact register-based bytecode and the interpreter that runs
+// it. Every value is a double; each function has a fixed register file whose
+// first registers hold its parameters. Calls count invocations, and once a
+// function has been called HotThreshold times the Promote callback is asked
+// for a native entry point, after which calls go straight to machine code.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef ZLANG_INTERPRETER_H
+#define ZLANG_INTERPRETER_H
+
+#include "SymbolTable.h"
+#include "llvm/ADT/FunctionExtras.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace zlang {
+namespace bc {
+
+enum Opcode : uint8_t {
+  LoadK,       // R[A] = K[B]
+  Move,        // R[A] = R[B]
+  Add,         // R[A] = R[B] + R[C]
+  Sub,         // R[A] = R[B] - R[C]
+  Mul,         // R[A] = R[B] * R[C]
+  CmpLT,       // R[A] = R[B] < R[C] or unordered ? 1.0 : 0.0
+  Jump,        // goto B
+  JumpIfFalse, // if !(R[A] != 0.0) goto B
+  JumpIfTrue,  // if R[A] != 0.0 goto B
+  Call,        // R[A] = Functions[C](R[B] .. R[B + NumParams - 1])
+  Ret,         // return R[A]
+  TailCall,    // return Functions[C](R[B] ..), looping if it is this function
+};
+
+struct Instr {
+  Opcode Op;
+  // a register, so a function may use at most UINT16_MAX + 1 registers.
+  uint16_t A;
+  uint32_t B, C;
+};
+
+struct Function {
+  std::string Name;
+  unsigned NumParams = 0;
+  unsigned NumRegs = 0;
+  std::vector<Instr> Code;
+  std::vector<double> Consts;
+
+  // False for externs, which only ever run natively.
+  bool HasBody = false;
+
+  // Native entry point once promoted (or resolved, for externs).
+  void *Native = nullptr;
+
+  // Invocations so far, towards promotion.
+  unsigned Calls = 0;
+};
+
+// Lowering state for one function: emission, register allocation and the
+// variable scope. Temporaries are allocated stack-wise above the variables.
+class Builder {
+private:
+  Function &F;
+  SymbolMap<unsigned> Scope; // SymbolID -> register + 1
+  unsigned Top = 0;
+
+public:
+  explicit Builder(Function &F) : F(F) {}
+
+  unsigned alloc() {
+    unsigned R = Top++;
+    if (Top > F.NumRegs)
+      F.NumRegs = Top;
+    return R;
+  }
+  unsigned getTop() const { return Top; }
+  void setTop(unsigned T) { Top = T; }
+
+  // Bind Name to register R, returning the previous binding + 1 (0 if none).
+  unsigned bind(SymbolID Name, unsigned R) {
+    unsigned Old = Scope.lookup(Name);
+    Scope.set(Name, R + 1);
+    return Old;
+  }
+  void restore(SymbolID Name, unsigned Old) {
+    if (Old)
+      Scope.set(Name, Old);
+    else
+      Scope.erase(Name);
+  }
+  // Return the register holding Name, or -1.
+  int lookup(SymbolID Name) const { return int(Scope.lookup(Name)) - 1; }
+
+  unsigned addConst(double V) {
+    F.Consts.push_back(V);
+    return F.Consts.size() - 1;
+  }
+
+  // Emit an instruction and return its index, for patching jump targets.
+  size_t emit(Opcode Op, unsigned A, uint32_t B = 0, uint32_t C = 0) {
+    F.Code.push_back(Instr{Op, static_cast<uint16_t>(A), B, C});
+    return F.Code.size() - 1;
+  }
+  size_t here() const { return F.Code.size(); }
+
+  // Turn every Call whose result is only moved along and then returned into
+  // a TailCall. Call once the function is complete.
+  void markTailCalls() {
+    for (Instr &C : F.Code) {
+      if (C.Op != Call)
+        continue;
+      unsigned R = C.A;
+      size_t PC = &C - F.Code.data() + 1;
+      // bounded, in case of a jump cycle.
+      for (size_t Steps = 0; Steps != F.Code.size(); ++Steps) {
+        const Instr &In = F.Code[PC];
+        if (In.Op == Move && In.B == R) {
+          R = In.A;
+          ++PC;
+        } else if (In.Op == Jump) {
+          PC = In.B;
+        } else {
+          if (In.Op == Ret && In.A == R)
+            C.Op = TailCall;
+          break;
+        }
+      }
+    }
+  }
+  // True if code emitted since From may write register R.
+  bool writes(size_t From, unsigned R) const {
+    for (size_t I = From, E = F.Code.size(); I != E; ++I) {
+      const Instr &In = F.Code[I];
+      if (In.A == R && In.Op != Jump && In.Op != JumpIfFalse &&
+          In.Op != JumpIfTrue && In.Op != Ret)
+        return true;
+    }
+    return false;
+  }
+  void patch(size_t At, size_t Target) {
+    F.Code[At].B = static_cast<uint32_t>(Target);
+  }
+};
+
+class Interpreter {
+public:
+  // Return a native entry point for F, or null to keep interpreting.
+  using PromoteFn = llvm::unique_function<void *(Function &F)>;
+
+private:
+  std::vector<std::unique_ptr<Function>> Functions;
+  unsigned HotThreshold;
+  PromoteFn Promote;
+
+  // The first function without a body that could not be given a native
+  // entry point, which stops the evaluation.
+  Function *Unresolved = nullptr;
+
+  static constexpr unsigned MaxNativeArgs = 8;
+
+  static double callNative(void *Addr, unsigned N, const double *A) {
+    switch (N) {
+    case 0: return reinterpret_cast<double (*)()>(Addr)();
+    case 1: return reinterpret_cast<double (*)(double)>(Addr)(A[0]);
+    case 2:
+      return reinterpret_cast<double (*)(double, double)>(Addr)(A[0], A[1]);
+    case 3:
+      return reinterpret_cast<double (*)(double, double, double)>(Addr)(
+          A[0], A[1], A[2]);
+    case 4:
+      return reinterpret_cast<double (*)(double, double, double, double)>(
+          Addr)(A[0], A[1], A[2], A[3]);
+    case 5:
+      return reinterpret_cast<double (*)(double, double, double, double,
+                                         double)>(Addr)(A[0], A[1], A[2], A[3],
+                                                        A[4]);
+    case 6:
+      return reinterpret_cast<double (*)(double, double, double, double,
+                                         double, double)>(Addr)(
+          A[0], A[1], A[2], A[3], A[4], A[5]);
+    case 7:
+      return reinterpret_cast<double (*)(double, double, double, double,
+                                         double, double, double)>(Addr)(
+          A[0], A[1], A[2], A[3], A[4], A[5], A[6]);
+    default:
+      return reinterpret_cast<double (*)(double, double, double, double,
+                                         double, double, double, double)>(
+          Addr)(A[0], A[1], A[2], A[3], A[4], A[5], A[6], A[7]);
+    }
+  }
+
+  void tryPromote(Function &F) {
+    if (F.NumParams <= MaxNativeArgs)
+      F.Native = Promote(F);
+  }
+
+  double invoke(Function &F, const double *Args) {
+    if (!F.Native && (!F.HasBody || ++F.Calls == HotThreshold))
+      tryPromote(F);
+    if (F.Native)
+      return callNative(F.Native, F.NumParams, Args);
+    if (!F.HasBody) {
+      if (!Unresolved)
+        Unresolved = &F;
+      return 0.0;
+    }
+    return run(F, Args);
+  }
+
+  double run(Function &F, const double *Args) {
+    llvm::SmallVector<double, 32> Regs(F.NumRegs);
+    std::copy(Args, Args + F.NumParams, Regs.begin());
+    double *R = Regs.data();
+    const double *K = F.Consts.data();
+    const Instr *Code = F.Code.data();
+    const Instr *I = Code;
+
+#if defined(__GNUC__)
+    // Threaded dispatch: every handler jumps straight to the next one.
+    static const void *const Labels[] = {
+        &&op_LoadK, &&op_Move,        &&op_Add,        &&op_Sub,
+        &&op_Mul,   &&op_CmpLT,       &&op_Jump,       &&op_JumpIfFalse,
+        &&op_JumpIfTrue, &&op_Call,   &&op_Ret,        &&op_TailCall,
+    };
+#define DISPATCH() goto *Labels[I->Op]
+#define CASE(Op) op_##Op:
+#define NEXT()                                                                 \
+  ++I;                                                                         \
+  DISPATCH()
+#define JUMP(Target)                                                           \
+  I = Code + (Target);                                                         \
+  DISPATCH()
+    DISPATCH();
+#else
+#define CASE(Op) case Op:
+#define NEXT()                                                                 \
+  ++I;                                                                         \
+  continue
+#define JUMP(Target)                                                           \
+  I = Code + (Target);                                                         \
+  continue
+    for (;;) {
+      switch (I->Op) {
+#endif
+    CASE(LoadK) R[I->A] = K[I->B]; NEXT();
+    CASE(Move) R[I->A] = R[I->B]; NEXT();
+    CASE(Add) R[I->A] = R[I->B] + R[I->C]; NEXT();
+    CASE(Sub) R[I->A] = R[I->B] - R[I->C]; NEXT();
+    CASE(Mul) R[I->A] = R[I->B] * R[I->C]; NEXT();
+    CASE(CmpLT) R[I->A] = !(R[I->B] >= R[I->C]) ? 1.0 : 0.0; NEXT();
+    CASE(Jump) JUMP(I->B);
+    CASE(JumpIfFalse)
+      if (!(R[I->A] < 0.0 || R[I->A] > 0.0)) {
+        JUMP(I->B);
+      }
+      NEXT();
+    CASE(JumpIfTrue)
+      if (R[I->A] < 0.0 || R[I->A] > 0.0) {
+        JUMP(I->B);
+      }
+      NEXT();
+    CASE(Call)
+      R[I->A] = invoke(*Functions[I->C], R + I->B);
+      // unwind once a callee could not be run.
+      if (Unresolved)
+        return 0.0;
+      NEXT();
+    CASE(Ret) return R[I->A];
+    CASE(TailCall) {
+      // a self call restarts this frame, still counting towards promotion.
+      Function &Callee = *Functions[I->C];
+      if (&Callee == &F && !F.Native) {
+        if (++F.Calls == HotThreshold)
+          tryPromote(F);
+        if (!F.Native) {
+          std::copy(R + I->B, R + I->B + F.NumParams, R);
+          JUMP(0);
+        }
+      }
+      return invoke(Callee, R + I->B);
+    }
+#if !defined(__GNUC__)
+      }
+    }
+#endif
+#undef CASE
+#undef NEXT
+#undef JUMP
+#undef DISPATCH
+  }
+
+public:
+  Interpreter(unsigned HotThreshold, PromoteFn Promote)
+      : HotThreshold(HotThreshold), Promote(std::move(Promote)) {}
+
+  // Functions can only be called natively with up to this many arguments.
+  static bool canCallNatively(unsigned NumParams) {
+    return NumParams <= MaxNativeArgs;
+  }
+
+  // Take ownership of F and return its index for Call instructions.
+  unsigned addFunction(std::unique_ptr<Function> F) {
+    Functions.push_back(std::move(F));
+    return Functions.size() - 1;
+  }
+
+  Function &getFunction(unsigned Idx) { return *Functions[Idx]; }
+
+  double call(Function &F, const double *Args) {
+    Unresolved = nullptr;
+    return invoke(F, Args);
+  }
+
+  // Run a parameterless body once, without counting it towards promotion.
+  double evaluate(Function &F) {
+    Unresolved = nullptr;
+    return run(F, nullptr);
+  }
+
+  // The function without a body that the last call() or evaluate() could not
+  // run, ending it early with a meaningless result; null if it completed.
+  const Function *getUnresolved() const { return Unresolved; }
+};
+
+} // end namespace bc
+} // end namespace zlang
+
+#endif // ZLANG_INTERPRETER_H
@@ -13,74 +13,408 @@
 #ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
+#include "ObjectCache.h"
+#include "PerfMap.h"
+#include "TimeReport.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/EPCIndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/ThreadPool.h"
+#include <functional>
 #include <memory>
 
 namespace llvm {
 namespace orc {
 
+struct KaleidoscopeJITOptions {
+  // Compile each function only the first time it is called.
+  bool Lazy = false;
+
+  // Number of worker threads for materialization; 0 runs it on the caller.
+  unsigned NumThreads = 0;
+
+  // 0-3. Selects the codegen level and, from 2 up, the module pipeline run
+  // on each module before it is compiled.
+  unsigned OptLevel = 1;
+
+  // Target CPU; empty or "host" means the host CPU along with the features
+  // it reports.
+  // Features are added on top, as a comma-separated "+avx2,-fma" list.
+  std::string CPU;
+  std::string Features;
+
+  // Fuse multiplies and adds wherever possible ("-ffp-contract=fast"), not
+  // only where the IR carries the contract flag.
+  bool FastMath = false;
+
+  // Directory for persisting compiled objects across runs; empty disables
+  // the cache. SizeLimit is in bytes, 0 meaning no limit.
+  std::string CacheDir;
+  uint64_t CacheSizeLimit = 0;
+
+  // Called with each module once it is optimized, just before codegen, and a
+  // TargetMachine for it. Runs on whichever thread materializes the module.
+  std::function<void(Module &, TargetMachine &)> NotifyOptimized;
+
+  // Called with each error the session cannot return to a caller, such as
+  // failing to materialize a symbol, on whichever thread it came up on. Null
+  // leaves ORC's default of printing them to stderr.
+  std::function<void(Error)> ReportError;
+
+  // Where to record the time spent optimizing, emitting, linking and looking
+  // up; null disables timing. Must outlive the JIT.
+  zlang::TimeReport *Timers = nullptr;
+
+  // Describe each object to profilers and debuggers as it is loaded: in
+  // /tmp/perf-<pid>.map for perf, as a jitdump file for "perf inject --jit"
+  // (under .debug/jit in $JITDUMPDIR, or else $HOME), and through GDB's JIT
+  // interface.
+  bool PerfMap = false;
+  bool JITDump = false;
+  bool GDBRegistration = false;
+};
+
+// Times each module compiled by another IRCompiler.
+class TimedIRCompiler : public IRCompileLayer::IRCompiler {
+private:
+  std::unique_ptr<IRCompiler> Compile;
+  zlang::TimeReport &Timers;
+
+public:
+  TimedIRCompiler(std::unique_ptr<IRCompiler> Compile, zlang::TimeReport &Timers)
+      : IRCompiler(Compile->getManglingOptions()), Compile(std::move(Compile)),
+        Timers(Timers) {}
+
+  Expected<std::unique_ptr<MemoryBuffer>> operator()(Module &M) override {
+    zlang::TimeReport::Scope Time(&Timers, zlang::TimeReport::Emit,
+                                  zlang::TimeReport::describe(M));
+    return (*Compile)(M);
+  }
+};
+
+// Times linking each object. RuntimeDyld links, and resolves any symbols it
+// can, before emit() returns.
+class TimedObjectLinkingLayer : public RTDyldObjectLinkingLayer {
+private:
+  zlang::TimeReport *Timers;
+
+public:
+  TimedObjectLinkingLayer(ExecutionSession &ES,
+                          GetMemoryManagerFunction GetMemoryManager,
+                          zlang::TimeReport *Timers)
+      : RTDyldObjectLinkingLayer(ES, std::move(GetMemoryManager)),
+        Timers(Timers) {}
+
+  void emit(std::unique_ptr<MaterializationResponsibility> R,
+            std::unique_ptr<MemoryBuffer> O) override {
+    std::string Name;
+    if (Timers && !R->getSymbols().empty())
+      Name = (*R->getSymbols().begin()->first).str();
+    zlang::TimeReport::Scope Time(Timers, zlang::TimeReport::Link, Name);
+    RTDyldObjectLinkingLayer::emit(std::move(R), std::move(O));
+  }
+};
+
+// Defines symbols whose module is only built, by a callback, once one of them
+// is looked up, and then sent down Layer.
+class DeferredModuleMaterializationUnit : public MaterializationUnit {
+public:
+  using LoadFunction = unique_function<Expected<ThreadSafeModule>()>;
+
+private:
+  IRLayer &Layer;
+  LoadFunction Load;
+
+  void discard(const JITDylib &JD, const SymbolStringPtr &Name) override {}
+
+public:
+  DeferredModuleMaterializationUnit(IRLayer &Layer, SymbolFlagsMap Symbols,
+                                    LoadFunction Load)
+      : MaterializationUnit(Interface(std::move(Symbols), nullptr)),
+        Layer(Layer), Load(std::move(Load)) {}
+
+  StringRef getName() const override { return "DeferredModule"; }
+
+  void materialize(std::unique_ptr<MaterializationResponsibility> R) override {
+    auto TSM = Load();
+    if (!TSM) {
+      Layer.getExecutionSession().reportError(TSM.takeError());
+      R->failMaterialization();
+      return;
+    }
+    Layer.emit(std::move(R), std::move(*TSM));
+  }
+};
+
 class KaleidoscopeJIT {
 private:
   std::unique_ptr<ExecutionSession> ES;
+  std::unique_ptr<EPCIndirectionUtils> EPCIU;
 
   DataLayout DL;
   MangleAndInterner Mangle;
 
-  RTDyldObjectLinkingLayer ObjectLayer;
+  std::unique_ptr<zlang::DiskObjectCache> ObjCache;
+
+  // Stubs made by addRedirectableSymbol(), which redirect() repoints.
+  std::unique_ptr<IndirectStubsManager> RedirectStubs;
+
+  // Declared ahead of ObjectLayer, which notifies it until the session ends.
+  std::unique_ptr<zlang::PerfMapListener> PerfMap;
+
+  // Reports the module pipeline's passes to Opts.Timers.
+  PassInstrumentationCallbacks PIC;
+
+  TimedObjectLinkingLayer ObjectLayer;
   IRCompileLayer CompileLayer;
+  IRTransformLayer OptimizeLayer;
+  CompileOnDemandLayer CODLayer;
 
   JITDylib &MainJD;
 
+  // Lazy sends modules through CODLayer: each function is replaced by a
+  // stub and only compiled the first time it is called.
+  KaleidoscopeJITOptions Opts;
+
+  // Kept to build a TargetMachine for the optimizer's cost models.
+  JITTargetMachineBuilder OptJTMB;
+
+  // Worker threads for materialization tasks; null when compiling on the
+  // calling thread.
+  std::unique_ptr<ThreadPool> CompileThreads;
+
+  static void handleLazyCallThroughError() {
+    errs() << "LazyCallThrough error: Could not find function body";
+    exit(1);
+  }
+
+  static std::unique_ptr<IRCompileLayer::IRCompiler>
+  createCompiler(JITTargetMachineBuilder JTMB, ObjectCache *Cache,
+                 zlang::TimeReport *Timers) {
+    auto Compile = std::make_unique<ConcurrentIRCompiler>(std::move(JTMB), Cache);
+    if (!Timers)
+      return std::move(Compile);
+    return std::make_unique<TimedIRCompiler>(std::move(Compile), *Timers);
+  }
+
+  Error registerEventListeners() {
+    if (Opts.PerfMap) {
+      auto L = zlang::PerfMapListener::Create();
+      if (!L)
+        return L.takeError();
+      PerfMap = std::move(*L);
+      ObjectLayer.registerJITEventListener(*PerfMap);
+    }
+    // both of these are process-wide and never freed.
+    if (Opts.JITDump) {
+      JITEventListener *L = JITEventListener::createPerfJITEventListener();
+      if (!L)
+        return createStringError(inconvertibleErrorCode(),
+                                 "this LLVM was built without jitdump support");
+      ObjectLayer.registerJITEventListener(*L);
+    }
+    if (Opts.GDBRegistration)
+      ObjectLayer.registerJITEventListener(
+          *JITEventListener::createGDBRegistrationListener());
+    return Error::success();
+  }
+
+  static CodeGenOpt::Level getCodeGenOptLevel(unsigned OptLevel) {
+    switch (OptLevel) {
+    case 0:
+      return CodeGenOpt::None;
+    case 1:
+      return CodeGenOpt::Less;
+    case 2:
+      return CodeGenOpt::Default;
+    default:
+      return CodeGenOpt::Aggressive;
+    }
+  }
+
+  // Run the default module pipeline (inlining, LICM, unrolling and the loop
+  // and SLP vectorizers) for the configured level. Below -O2 the per-function
+  // cleanup done at codegen time is all we run.
+  Expected<ThreadSafeModule> optimizeModule(ThreadSafeModule TSM,
+                                            MaterializationResponsibility &R) {
+    if (Opts.OptLevel < 2 && !Opts.NotifyOptimized)
+      return std::move(TSM);
+
+    auto TM = OptJTMB.createTargetMachine();
+    if (!TM)
+      return TM.takeError();
+
+    if (Opts.OptLevel < 2) {
+      TSM.withModuleDo([&](Module &M) { Opts.NotifyOptimized(M, **TM); });
+      return std::move(TSM);
+    }
+
+    OptimizationLevel Level =
+        Opts.OptLevel == 2 ? OptimizationLevel::O2 : OptimizationLevel::O3;
+    TSM.withModuleDo(
+        [&](Module &M) { runModulePipeline(M, **TM, Level, PipelineTuningOptions()); });
+    return std::move(TSM);
+  }
+
+  void runModulePipeline(Module &M, TargetMachine &TM, OptimizationLevel Level,
+                         PipelineTuningOptions PTO) {
+    PTO.LoopVectorization = true;
+    PTO.SLPVectorization = true;
+
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+
+    PassBuilder PB(&TM, PTO, None, Opts.Timers ? &PIC : nullptr);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    PB.buildPerModuleDefaultPipeline(Level).run(M, MAM);
+    if (Opts.NotifyOptimized)
+      Opts.NotifyOptimized(M, TM);
+  }
+
+  static bool definesVectorParams(Module &M) {
+    for (Function &F : M)
+      if (!F.isDeclaration() && any_of(F.args(), [](Argument &A) {
+            return A.getType()->isVectorTy();
+          }))
+        return true;
+    return false;
+  }
+
 public:
   KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
-                  JITTargetMachineBuilder JTMB, DataLayout DL)
-      : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
+                  std::unique_ptr<EPCIndirectionUtils> EPCIU,
+                  JITTargetMachineBuilder JTMB, DataLayout DL,
+                  KaleidoscopeJITOptions Opts)
+      : ES(std::move(ES)), EPCIU(std::move(EPCIU)), DL(std::move(DL)),
+        Mangle(*this->ES, this->DL),
+        ObjCache(Opts.CacheDir.empty()
+                     ? nullptr
+                     : std::make_unique<zlang::DiskObjectCache>(
+                           Opts.CacheDir, JTMB, Opts.OptLevel,
+                           Opts.CacheSizeLimit)),
         ObjectLayer(*this->ES,
-                    []() { return std::make_unique<SectionMemoryManager>(); }),
+                    []() { return std::make_unique<SectionMemoryManager>(); },
+                    Opts.Timers),
         CompileLayer(*this->ES, ObjectLayer,
-                     std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
-        MainJD(this->ES->createBareJITDylib("<main>")) {
+                     createCompiler(JTMB, ObjCache.get(), Opts.Timers)),
+        OptimizeLayer(*this->ES, CompileLayer,
+                      [this](ThreadSafeModule TSM,
+                             MaterializationResponsibility &R) {
+                        return optimizeModule(std::move(TSM), R);
+                      }),
+        CODLayer(*this->ES, OptimizeLayer,
+                 this->EPCIU->getLazyCallThroughManager(),
+                 [this] { return this->EPCIU->createIndirectStubsManager(); }),
+        MainJD(this->ES->createBareJITDylib("<main>")), Opts(Opts),
+        OptJTMB(std::move(JTMB)) {
+    if (Opts.Timers)
+      Opts.Timers->registerCallbacks(PIC);
     MainJD.addGenerator(
         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
             DL.getGlobalPrefix())));
-    if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
+    if (OptJTMB.getTargetTriple().isOSBinFormatCOFF()) {
       ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
       ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
     }
+    if (Opts.NumThreads > 0) {
+      // Partitions share their source module's context, which would serialize
+      // their compiles on its lock.
+      CODLayer.setCloneToNewContextOnEmit(true);
+      CompileThreads =
+          std::make_unique<ThreadPool>(hardware_concurrency(Opts.NumThreads));
+      this->ES->setDispatchTask([this](std::unique_ptr<Task> T) {
+        // ThreadPool tasks must be copyable, so pass the task unowned.
+        CompileThreads->async([UnownedT = T.release()]() {
+          std::unique_ptr<Task> T(UnownedT);
+          T->run();
+        });
+      });
+    }
   }
 
   ~KaleidoscopeJIT() {
+    if (CompileThreads)
+      CompileThreads->wait();
     if (auto Err = ES->endSession())
       ES->reportError(std::move(Err));
+    if (auto Err = EPCIU->cleanup())
+      ES->reportError(std::move(Err));
   }
 
-  static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
+  static Expected<std::unique_ptr<KaleidoscopeJIT>>
+  Create(const KaleidoscopeJITOptions &Opts = KaleidoscopeJITOptions()) {
     auto EPC = SelfExecutorProcessControl::Create();
     if (!EPC)
       return EPC.takeError();
 
     auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
+    if (Opts.ReportError)
+      ES->setErrorReporter(Opts.ReportError);
+
+    auto EPCIU = EPCIndirectionUtils::Create(ES->getExecutorProcessControl());
+    if (!EPCIU)
+      return EPCIU.takeError();
+
+    (*EPCIU)->createLazyCallThroughManager(
+        *ES, pointerToJITTargetAddress(&handleLazyCallThroughError));
+
+    if (auto Err = setUpInProcessLCTMReentryViaEPCIU(**EPCIU))
+      return std::move(Err);
 
     JITTargetMachineBuilder JTMB(
         ES->getExecutorProcessControl().getTargetTriple());
+    if (Opts.CPU.empty() || Opts.CPU == "host") {
+      JTMB.setCPU(sys::getHostCPUName().str());
+      StringMap<bool> HostFeatures;
+      if (sys::getHostCPUFeatures(HostFeatures))
+        for (auto &F : HostFeatures)
+          JTMB.getFeatures().AddFeature(F.first(), F.second);
+    } else {
+      JTMB.setCPU(Opts.CPU);
+    }
+    if (!Opts.Features.empty()) {
+      SmallVector<StringRef, 8> Features;
+      StringRef(Opts.Features).split(Features, ',', -1, /*KeepEmpty=*/false);
+      JTMB.addFeatures(std::vector<std::string>(Features.begin(), Features.end()));
+    }
+    JTMB.setCodeGenOptLevel(getCodeGenOptLevel(Opts.OptLevel));
+    if (Opts.FastMath)
+      JTMB.getOptions().AllowFPOpFusion = FPOpFusion::Fast;
 
     auto DL = JTMB.getDefaultDataLayoutForTarget();
     if (!DL)
       return DL.takeError();
 
-    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
-                                             std::move(*DL));
+    auto JIT = std::make_unique<KaleidoscopeJIT>(
+        std::move(ES), std::move(*EPCIU), std::move(JTMB), std::move(*DL),
+        Opts);
+    if (auto Err = JIT->registerEventListeners())
+      return std::move(Err);
+    return std::move(JIT);
   }
 
   const DataLayout &getDataLayout() const { return DL; }
@@ -90,10 +424,76 @@ public:
   Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
     if (!RT)
       RT = MainJD.getDefaultResourceTracker();
-    return CompileLayer.add(RT, std::move(TSM));
+    // the lazy call-through only keeps the low half of vector argument
+    // registers (xmm of ymm), so such functions are compiled eagerly.
+    if (Opts.Lazy && !TSM.withModuleDo(definesVectorParams))
+      return CODLayer.add(RT, std::move(TSM));
+    return OptimizeLayer.add(RT, std::move(TSM));
+  }
+
+  // Add a module that bypasses the lazy layer. Used for top-level
+  // expressions, which are called right away and then removed.
+  Error addEagerModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
+    if (!RT)
+      RT = MainJD.getDefaultResourceTracker();
+    return OptimizeLayer.add(RT, std::move(TSM));
+  }
+
+  // Define Name, which is compiled from the module Load returns once it is
+  // first looked up. The module must define Name and nothing else external.
+  Error addDeferredModule(StringRef Name,
+                          DeferredModuleMaterializationUnit::LoadFunction Load) {
+    SymbolFlagsMap Symbols;
+    Symbols[Mangle(Name.str())] =
+        JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+    return MainJD.define(std::make_unique<DeferredModuleMaterializationUnit>(
+        OptimizeLayer, std::move(Symbols), std::move(Load)));
+  }
+
+  // Remove the modules tracked by RT. Worker threads may still be finishing
+  // the bookkeeping for a module whose symbols are already ready, so let them
+  // drain first.
+  Error removeModule(ResourceTrackerSP RT) {
+    if (CompileThreads)
+      CompileThreads->wait();
+    return RT->remove();
+  }
+
+  // Define Name as a stub that calls Target, which is compiled on the first
+  // call. redirect() can later point the stub somewhere else.
+  Error addRedirectableSymbol(StringRef Name, StringRef Target) {
+    if (!RedirectStubs)
+      RedirectStubs = EPCIU->createIndirectStubsManager();
+    SymbolAliasMap Aliases;
+    Aliases[Mangle(Name.str())] = SymbolAliasMapEntry(
+        Mangle(Target.str()), JITSymbolFlags::Exported | JITSymbolFlags::Callable);
+    return MainJD.define(lazyReexports(EPCIU->getLazyCallThroughManager(),
+                                      *RedirectStubs, MainJD,
+                                      std::move(Aliases)));
+  }
+
+  // Send calls through Name's stub to Addr. Safe while the stub is in use.
+  Error redirect(StringRef Name, JITTargetAddress Addr) {
+    return RedirectStubs->updatePointer(*Mangle(Name.str()), Addr);
+  }
+
+  // Add a module that is run through the -O3 pipeline, with PTO, instead of
+  // the one for the JIT's level. It is compiled on first lookup and stays
+  // until the session ends.
+  Error addModuleAtO3(ThreadSafeModule TSM, PipelineTuningOptions PTO) {
+    auto TM = OptJTMB.createTargetMachine();
+    if (!TM)
+      return TM.takeError();
+    TSM.withModuleDo([&](Module &M) {
+      // tuned to this run's profile, so not worth caching.
+      zlang::DiskObjectCache::markUncached(M);
+      runModulePipeline(M, **TM, OptimizationLevel::O3, PTO);
+    });
+    return CompileLayer.add(MainJD.getDefaultResourceTracker(), std::move(TSM));
   }
 
   Expected<JITEvaluatedSymbol> lookup(StringRef Name) {
+    zlang::TimeReport::Scope Time(Opts.Timers, zlang::TimeReport::Lookup, Name);
     return ES->lookup({&MainJD}, Mangle(Name.str()));
   }
 };
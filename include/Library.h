@@ -0,0 +1,217 @@
+//===- Library.h - Precompiled zlang libraries ------------------*- C++ -*-===//
+//
+// Contains the reader and writer for library bundles, which hold a set of
+// compiled definitions so that other programs can import them without
+// parsing their source again. A bundle starts with an index of the
+// prototypes, then has the bitcode of each definition as a module of its
+// own: the function, the internal functions and globals it uses, and
+// declarations of everything else it calls. A bundle is read through a
+// memory map, and each module is only parsed when it is needed.
+//
+// Layout, little-endian:
+//   "ZLANGLIB", u32 version, u32 vector width, u32 function count,
+//   u32 index size, the index, then the modules from the next multiple of 8.
+//   Each index entry is:
+//   string name, u32 argument count, (u8 type, string name) per argument,
+//   u8 return type, u8 flags, u32 IR instruction count,
+//   and then u64 offset and u64 size of its module counting from the first.
+//   A string is a u32 length and its bytes.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef ZLANG_LIBRARY_H
+#define ZLANG_LIBRARY_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/BinaryByteStream.h"
+#include "llvm/Support/BinaryStreamReader.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace zlang {
+
+struct LibraryFunction {
+  enum : uint8_t {
+    // No side effects, so calls may be memoized.
+    Pure = 1,
+    // Uses nothing internal to its module, so it may be inlined elsewhere.
+    Inlinable = 2,
+  };
+
+  std::string Name;
+  std::vector<std::string> ArgNames;
+  // ValType of each argument and of the result.
+  std::vector<uint8_t> ArgTypes;
+  uint8_t RetType = 0;
+  uint8_t Flags = 0;
+  unsigned NumInstructions = 0;
+  // the bitcode; for a library that was read, it points into the map.
+  llvm::StringRef Bitcode;
+};
+
+class Library {
+private:
+  enum : uint32_t { Version = 1, HeaderSize = 8 + 4 * 4 };
+  static llvm::StringRef magic() { return "ZLANGLIB"; }
+
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;
+
+  static llvm::Error malformed(llvm::StringRef Path, llvm::StringRef What) {
+    return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                   "%s: malformed library: %s",
+                                   Path.str().c_str(), What.str().c_str());
+  }
+
+  // Read into V, returning false if the stream ends first.
+  template <typename T> static bool read(llvm::BinaryStreamReader &R, T &V) {
+    if (llvm::Error Err = R.readInteger(V)) {
+      llvm::consumeError(std::move(Err));
+      return false;
+    }
+    return true;
+  }
+
+  static bool read(llvm::BinaryStreamReader &R, std::string &S) {
+    uint32_t Len;
+    llvm::StringRef Ref;
+    if (!read(R, Len))
+      return false;
+    if (llvm::Error Err = R.readFixedString(Ref, Len)) {
+      llvm::consumeError(std::move(Err));
+      return false;
+    }
+    S = Ref.str();
+    return true;
+  }
+
+  static void writeString(llvm::support::endian::Writer &W,
+                          llvm::StringRef S) {
+    W.write<uint32_t>(S.size());
+    W.OS << S;
+  }
+
+public:
+  unsigned VectorWidth = 0;
+  std::vector<LibraryFunction> Functions;
+
+  // Map the library at Path and read its index.
+  static llvm::Expected<std::unique_ptr<Library>> open(llvm::StringRef Path) {
+    auto Buf = llvm::MemoryBuffer::getFile(Path, /*IsText=*/false,
+                                           /*RequiresNullTerminator=*/false);
+    if (!Buf)
+      return llvm::createFileError(Path, Buf.getError());
+    auto L = std::make_unique<Library>();
+    L->Buffer = std::move(*Buf);
+    llvm::StringRef Data = L->Buffer->getBuffer();
+    if (!Data.startswith(magic()))
+      return malformed(Path, "not a zlang library");
+
+    llvm::BinaryByteStream Stream(Data, llvm::support::little);
+    llvm::BinaryStreamReader R(Stream);
+    R.setOffset(magic().size());
+    uint32_t FileVersion, Width, NumFunctions, IndexSize;
+    if (!read(R, FileVersion) || !read(R, Width) || !read(R, NumFunctions) ||
+        !read(R, IndexSize))
+      return malformed(Path, "truncated header");
+    if (FileVersion != Version)
+      return llvm::createStringError(
+          llvm::inconvertibleErrorCode(),
+          "%s: library format version %u, expected %u", Path.str().c_str(),
+          FileVersion, uint32_t(Version));
+    L->VectorWidth = Width;
+
+    uint64_t DataStart = llvm::alignTo(uint64_t(HeaderSize) + IndexSize, 8);
+    if (DataStart > Data.size())
+      return malformed(Path, "truncated index");
+    llvm::StringRef Modules = Data.drop_front(DataStart);
+    for (uint32_t i = 0; i != NumFunctions; ++i) {
+      LibraryFunction F;
+      uint32_t NumArgs;
+      if (!read(R, F.Name) || !read(R, NumArgs) ||
+          NumArgs > R.bytesRemaining())
+        return malformed(Path, "truncated index");
+      F.ArgNames.resize(NumArgs);
+      F.ArgTypes.resize(NumArgs);
+      for (uint32_t j = 0; j != NumArgs; ++j) {
+        if (!read(R, F.ArgTypes[j]) || !read(R, F.ArgNames[j]))
+          return malformed(Path, "truncated index");
+      }
+      uint32_t NumInstructions;
+      uint64_t Offset, Size;
+      if (!read(R, F.RetType) || !read(R, F.Flags) ||
+          !read(R, NumInstructions) || !read(R, Offset) || !read(R, Size))
+        return malformed(Path, "truncated index");
+      // the bitcode reader works in 32-bit words.
+      if (Offset > Modules.size() || Size > Modules.size() - Offset ||
+          Offset % 4 || Size % 4)
+        return malformed(Path, "bad module bounds for " + F.Name);
+      F.NumInstructions = NumInstructions;
+      F.Bitcode = Modules.substr(Offset, Size);
+      L->Functions.push_back(std::move(F));
+    }
+    if (R.getOffset() != HeaderSize + IndexSize)
+      return malformed(Path, "index size does not match");
+    return std::move(L);
+  }
+
+  // Write the functions, with their bitcode, as a library at Path.
+  static llvm::Error write(llvm::StringRef Path, unsigned VectorWidth,
+                           llvm::ArrayRef<LibraryFunction> Functions) {
+    std::string Index;
+    llvm::raw_string_ostream IndexOS(Index);
+    llvm::support::endian::Writer IW(IndexOS, llvm::support::little);
+    uint64_t Offset = 0;
+    for (const LibraryFunction &F : Functions) {
+      writeString(IW, F.Name);
+      IW.write<uint32_t>(F.ArgNames.size());
+      for (size_t j = 0, e = F.ArgNames.size(); j != e; ++j) {
+        IW.write<uint8_t>(F.ArgTypes[j]);
+        writeString(IW, F.ArgNames[j]);
+      }
+      IW.write<uint8_t>(F.RetType);
+      IW.write<uint8_t>(F.Flags);
+      IW.write<uint32_t>(F.NumInstructions);
+      IW.write<uint64_t>(Offset);
+      IW.write<uint64_t>(F.Bitcode.size());
+      Offset += llvm::alignTo(F.Bitcode.size(), 8);
+    }
+    IndexOS.flush();
+
+    std::error_code EC;
+    llvm::ToolOutputFile Out(Path, EC, llvm::sys::fs::OF_None);
+    if (EC)
+      return llvm::createFileError(Path, EC);
+    llvm::raw_fd_ostream &OS = Out.os();
+    llvm::support::endian::Writer W(OS, llvm::support::little);
+    OS << magic();
+    W.write<uint32_t>(Version);
+    W.write<uint32_t>(VectorWidth);
+    W.write<uint32_t>(Functions.size());
+    W.write<uint32_t>(Index.size());
+    OS << Index;
+    OS.write_zeros(llvm::alignTo(HeaderSize + Index.size(), 8) - HeaderSize -
+                   Index.size());
+    for (const LibraryFunction &F : Functions) {
+      OS << F.Bitcode;
+      OS.write_zeros(llvm::alignTo(F.Bitcode.size(), 8) - F.Bitcode.size());
+    }
+    OS.flush();
+    if (OS.has_error())
+      return llvm::createFileError(Path, OS.error());
+    Out.keep();
+    return llvm::Error::success();
+  }
+};
+
+} // end namespace zlang
+
+#endif // ZLANG_LIBRARY_H
@@ -0,0 +1,167 @@
+//===- ObjectCache.h - Persistent object cache for zlang --------*- C++ -*-===//
+//
+// Contains an ObjectCache that keeps objects compiled by the JIT on disk, so
+// later runs can load them instead of running codegen again. Entries are
+// keyed by a SHA1 of the module's bitcode plus the target triple, CPU,
+// features, codegen level and FP contraction mode. The directory is pruned
+// to a size limit with LLVM's cache pruning, which only manages files named
+// "llvmcache-*", when it is opened and whenever objects written since take it
+// over the limit. Modules marked with markUncached() are left out, as their
+// code is only good for the process that built them.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef ZLANG_OBJECTCACHE_H
+#define ZLANG_OBJECTCACHE_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+#include <chrono>
+#include <mutex>
+#include <string>
+
+namespace zlang {
+
+class DiskObjectCache : public llvm::ObjectCache {
+private:
+  std::string Dir;
+
+  static llvm::StringRef uncachedFlag() { return "zlang.uncached"; }
+
+  // Target description mixed into every key.
+  std::string TargetKey;
+
+  // Pruning policy, and the size of the "llvmcache-*" files as of the last
+  // prune plus every object written since.
+  llvm::CachePruningPolicy Policy;
+  std::mutex SizeMutex;
+  uint64_t Size = 0;
+
+  // Keys computed in getObject(), by module. Codegen rewrites the IR before
+  // notifyObjectCompiled() is called, so the module cannot be hashed again.
+  std::mutex KeysMutex;
+  llvm::DenseMap<const llvm::Module *, std::string> PendingKeys;
+
+  std::string computeKey(const llvm::Module &M) const {
+    llvm::SmallVector<char, 0> Bitcode;
+    llvm::raw_svector_ostream OS(Bitcode);
+    llvm::WriteBitcodeToFile(M, OS);
+
+    llvm::SHA1 Hasher;
+    Hasher.update(TargetKey);
+    Hasher.update(llvm::StringRef(Bitcode.data(), Bitcode.size()));
+    return llvm::toHex(Hasher.final(), /*LowerCase=*/true);
+  }
+
+  std::string getPath(llvm::StringRef Key) const {
+    llvm::SmallString<128> Path(Dir);
+    llvm::sys::path::append(Path, "llvmcache-" + Key);
+    return std::string(Path);
+  }
+
+  void prune() {
+    llvm::pruneCache(Dir, Policy);
+    Size = 0;
+    std::error_code EC;
+    for (llvm::sys::fs::directory_iterator I(Dir, EC), E; I != E && !EC;
+         I.increment(EC)) {
+      if (!llvm::sys::path::filename(I->path()).startswith("llvmcache-"))
+        continue;
+      if (auto Status = I->status())
+        Size += Status->getSize();
+    }
+  }
+
+public:
+  DiskObjectCache(llvm::StringRef Dir,
+                  const llvm::orc::JITTargetMachineBuilder &JTMB,
+                  unsigned OptLevel, uint64_t SizeLimit)
+      : Dir(Dir.str()) {
+    llvm::raw_string_ostream OS(TargetKey);
+    OS << JTMB.getTargetTriple().str() << '\0' << JTMB.getCPU() << '\0'
+       << JTMB.getFeatures().getString() << '\0'
+       << OptLevel << '\0' << unsigned(JTMB.getOptions().AllowFPOpFusion)
+       << '\0';
+    OS.flush();
+
+    llvm::sys::fs::create_directories(this->Dir);
+    // pruneCache() skips pruning within Interval of the last one, which is
+    // longer than most sessions.
+    Policy.Interval = std::chrono::seconds(0);
+    Policy.MaxSizeBytes = SizeLimit;
+    prune();
+  }
+
+  // Keep M out of the cache, such as for code that embeds addresses in this
+  // process. Its object is neither looked up nor written.
+  static void markUncached(llvm::Module &M) {
+    M.addModuleFlag(llvm::Module::Warning, uncachedFlag(), 1);
+  }
+
+  std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *M) override {
+    // with no key recorded, notifyObjectCompiled() writes nothing either.
+    if (M->getModuleFlag(uncachedFlag()))
+      return nullptr;
+    std::string Key = computeKey(*M);
+    auto Obj = llvm::MemoryBuffer::getFile(getPath(Key), /*IsText=*/false,
+                                           /*RequiresNullTerminator=*/false);
+
+    if (!Obj) {
+      std::lock_guard<std::mutex> Lock(KeysMutex);
+      PendingKeys[M] = std::move(Key);
+      return nullptr;
+    }
+    return std::move(*Obj);
+  }
+
+  void notifyObjectCompiled(const llvm::Module *M,
+                            llvm::MemoryBufferRef Obj) override {
+    std::string Key;
+    {
+      std::lock_guard<std::mutex> Lock(KeysMutex);
+      auto I = PendingKeys.find(M);
+      if (I == PendingKeys.end())
+        return;
+      Key = std::move(I->second);
+      PendingKeys.erase(I);
+    }
+
+    // Write to a temporary and rename it into place, so that concurrent
+    // processes never see a partial object.
+    std::string Path = getPath(Key);
+    auto Temp = llvm::sys::fs::TempFile::create(Path + ".tmp-%%%%%%");
+    if (!Temp) {
+      llvm::consumeError(Temp.takeError());
+      return;
+    }
+    {
+      llvm::raw_fd_ostream OS(Temp->FD, /*shouldClose=*/false);
+      OS << Obj.getBuffer();
+    }
+    if (auto Err = Temp->keep(Path)) {
+      llvm::consumeError(std::move(Err));
+      llvm::consumeError(Temp->discard());
+      return;
+    }
+
+    std::lock_guard<std::mutex> Lock(SizeMutex);
+    Size += Obj.getBufferSize();
+    if (Policy.MaxSizeBytes && Size > Policy.MaxSizeBytes)
+      prune();
+  }
+};
+
+} // end namespace zlang
+
+#endif // ZLANG_OBJECTCACHE_H
@@ -0,0 +1,89 @@
+//===- PerfMap.h - perf symbol map for JIT'd code ---------------*- C++ -*-===//
+//
+// Contains a JITEventListener that writes the function symbols of every
+// loaded object to /tmp/perf-<pid>.map, where "perf report" looks up
+// addresses it cannot find in a mapped file. Lines are only ever appended, so
+// the code of a removed module keeps its entry after its memory is reused.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef ZLANG_PERFMAP_H
+#define ZLANG_PERFMAP_H
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/RuntimeDyld.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace zlang {
+
+class PerfMapListener : public llvm::JITEventListener {
+private:
+  std::mutex Mutex;
+  std::unique_ptr<llvm::raw_fd_ostream> OS;
+
+  explicit PerfMapListener(std::unique_ptr<llvm::raw_fd_ostream> OS)
+      : OS(std::move(OS)) {}
+
+public:
+  // Open the map for this process. It is appended to, so that every engine
+  // in the process can have its own listener.
+  static llvm::Expected<std::unique_ptr<PerfMapListener>> Create() {
+    std::string Path =
+        "/tmp/perf-" + std::to_string(llvm::sys::Process::getProcessId()) +
+        ".map";
+    std::error_code EC;
+    auto OS = std::make_unique<llvm::raw_fd_ostream>(
+        Path, EC, llvm::sys::fs::OF_Append | llvm::sys::fs::OF_Text);
+    if (EC)
+      return llvm::createFileError(Path, EC);
+    return std::unique_ptr<PerfMapListener>(new PerfMapListener(std::move(OS)));
+  }
+
+  void notifyObjectLoaded(ObjectKey K, const llvm::object::ObjectFile &Obj,
+                          const llvm::RuntimeDyld::LoadedObjectInfo &L) override {
+    // symbol addresses in the debug object are where the code was loaded.
+    auto DebugObj = L.getObjectForDebug(Obj);
+    if (!DebugObj.getBinary())
+      return;
+
+    std::lock_guard<std::mutex> Lock(Mutex);
+    for (const auto &P : llvm::object::computeSymbolSizes(*DebugObj.getBinary())) {
+      llvm::object::SymbolRef Sym = P.first;
+      auto Type = Sym.getType();
+      if (!Type) {
+        llvm::consumeError(Type.takeError());
+        continue;
+      }
+      if (*Type != llvm::object::SymbolRef::ST_Function || !P.second)
+        continue;
+      auto Name = Sym.getName();
+      if (!Name) {
+        llvm::consumeError(Name.takeError());
+        continue;
+      }
+      auto Addr = Sym.getAddress();
+      if (!Addr) {
+        llvm::consumeError(Addr.takeError());
+        continue;
+      }
+      *OS << llvm::format("%llx %llx ", (unsigned long long)*Addr,
+                          (unsigned long long)P.second)
+          << *Name << "\n";
+    }
+    // written in one piece, so lines from other listeners do not interleave.
+    OS->flush();
+  }
+};
+
+} // end namespace zlang
+
+#endif // ZLANG_PERFMAP_H
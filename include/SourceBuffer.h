@@ -0,0 +1,138 @@
+//===- SourceBuffer.h - Buffered lexer input for zlang ----------*- C++ -*-===//
+//
+// Contains the input layer used by the zlang lexer. Source text is exposed as
+// a contiguous [Cur, End) range that the lexer walks with pointer advances.
+// Files are memory-mapped in one piece; standard input is pulled in large
+// chunks, which keeps the interactive REPL working because a read from a TTY
+// returns as soon as a line is available.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef ZLANG_SOURCEBUFFER_H
+#define ZLANG_SOURCEBUFFER_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+namespace zlang {
+
+class SourceBuffer {
+private:
+  // Backing storage for file input; null when reading from stdin.
+  std::unique_ptr<llvm::MemoryBuffer> File;
+
+  // Backing storage for stdin input.
+  std::unique_ptr<char[]> Chunk;
+  size_t ChunkSize = 0;
+  bool AtEOF = false;
+
+  const char *Cur = nullptr;
+  const char *End = nullptr;
+
+  // Start of the token being scanned, preserved across refills.
+  const char *Mark = nullptr;
+
+  static constexpr size_t DefaultChunkSize = 64 * 1024;
+
+  SourceBuffer() = default;
+
+  // Pull the next chunk of stdin. Any text after Mark is shifted to the front
+  // of the chunk so that the current token stays contiguous.
+  bool refill() {
+    if (File || AtEOF)
+      return false;
+
+    size_t Keep = Mark ? End - Mark : 0;
+    if (Keep == ChunkSize) {
+      size_t NewSize = ChunkSize * 2;
+      std::unique_ptr<char[]> NewChunk(new char[NewSize]);
+      memcpy(NewChunk.get(), Mark, Keep);
+      Chunk = std::move(NewChunk);
+      ChunkSize = NewSize;
+    } else if (Keep) {
+      memmove(Chunk.get(), Mark, Keep);
+    }
+    if (Mark)
+      Mark = Chunk.get();
+
+    auto Read = llvm::sys::fs::readNativeFile(
+        llvm::sys::fs::getStdinHandle(),
+        llvm::MutableArrayRef<char>(Chunk.get() + Keep, ChunkSize - Keep));
+    size_t N = 0;
+    if (Read)
+      N = *Read;
+    else
+      llvm::consumeError(Read.takeError());
+    if (N == 0)
+      AtEOF = true;
+
+    Cur = Chunk.get() + Keep;
+    End = Cur + N;
+    return N != 0;
+  }
+
+public:
+  SourceBuffer(const SourceBuffer &) = delete;
+  SourceBuffer &operator=(const SourceBuffer &) = delete;
+
+  // Memory-map the named file, or read stdin if Path is "-".
+  static llvm::Expected<std::unique_ptr<SourceBuffer>>
+  Create(llvm::StringRef Path) {
+    std::unique_ptr<SourceBuffer> SB(new SourceBuffer());
+    if (Path == "-") {
+      SB->ChunkSize = DefaultChunkSize;
+      SB->Chunk.reset(new char[SB->ChunkSize]);
+      SB->Cur = SB->End = SB->Chunk.get();
+      return std::move(SB);
+    }
+
+    auto MB = llvm::MemoryBuffer::getFile(Path, /*IsText=*/false,
+                                          /*RequiresNullTerminator=*/false);
+    if (!MB)
+      return llvm::createFileError(Path, MB.getError());
+    SB->File = std::move(*MB);
+    SB->Cur = SB->File->getBufferStart();
+    SB->End = SB->File->getBufferEnd();
+    return std::move(SB);
+  }
+
+  // Read Text in place. It must outlive the SourceBuffer.
+  static std::unique_ptr<SourceBuffer> CreateFromText(llvm::StringRef Text) {
+    std::unique_ptr<SourceBuffer> SB(new SourceBuffer());
+    SB->File = llvm::MemoryBuffer::getMemBuffer(
+        Text, "<text>", /*RequiresNullTerminator=*/false);
+    SB->Cur = SB->File->getBufferStart();
+    SB->End = SB->File->getBufferEnd();
+    return SB;
+  }
+
+  // Return the current character without consuming it, or EOF.
+  int peek() {
+    if (Cur == End && !refill())
+      return EOF;
+    return static_cast<unsigned char>(*Cur);
+  }
+
+  // Consume the current character. Only valid after peek() returned non-EOF.
+  void advance() { ++Cur; }
+
+  // Begin a token at the current position.
+  void beginToken() { Mark = Cur; }
+
+  // Return the text scanned since beginToken(). The reference is valid until
+  // the next call to peek().
+  llvm::StringRef takeToken() {
+    llvm::StringRef Text(Mark, Cur - Mark);
+    Mark = nullptr;
+    return Text;
+  }
+};
+
+} // end namespace zlang
+
+#endif // ZLANG_SOURCEBUFFER_H
@@ -0,0 +1,89 @@
+//===- SymbolTable.h - Identifier interning for zlang -----------*- C++ -*-===//
+//
+// Contains the symbol table used to intern identifiers. The lexer hands each
+// identifier over as a view into the source buffer; interning maps it to a
+// compact SymbolID so that the parser, AST and codegen compare and look up
+// names by integer instead of by string.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef ZLANG_SYMBOLTABLE_H
+#define ZLANG_SYMBOLTABLE_H
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace zlang {
+
+using SymbolID = unsigned;
+
+class SymbolTable {
+private:
+  llvm::StringMap<SymbolID> IDs;
+
+  // Names indexed by SymbolID. These refer to the keys owned by IDs, which
+  // never move once inserted.
+  std::vector<llvm::StringRef> Names;
+
+public:
+  // Return the ID for Name, assigning the next free one on first use. IDs are
+  // handed out densely starting at 0.
+  SymbolID intern(llvm::StringRef Name) {
+    auto R = IDs.try_emplace(Name, static_cast<SymbolID>(Names.size()));
+    if (R.second)
+      Names.push_back(R.first->getKey());
+    return R.first->second;
+  }
+
+  llvm::StringRef name(SymbolID ID) const { return Names[ID]; }
+
+  size_t size() const { return Names.size(); }
+};
+
+// A map from SymbolID to T, stored as an array indexed by ID. Because IDs are
+// dense, lookups are a bounds check and a load, and clear() is O(1): it bumps
+// a generation counter that invalidates every entry at once.
+template <typename T> class SymbolMap {
+private:
+  struct Slot {
+    T Val;
+    unsigned Gen;
+  };
+  std::vector<Slot> Slots;
+  unsigned Gen = 1;
+
+public:
+  // Return the value bound to ID, or a value-initialized T if there is none.
+  T lookup(SymbolID ID) const {
+    if (ID < Slots.size() && Slots[ID].Gen == Gen)
+      return Slots[ID].Val;
+    return T();
+  }
+
+  void set(SymbolID ID, T Val) {
+    if (ID >= Slots.size())
+      Slots.resize(std::max<size_t>(ID + 1, Slots.size() * 2), Slot{T(), 0});
+    Slots[ID] = Slot{std::move(Val), Gen};
+  }
+
+  void erase(SymbolID ID) {
+    if (ID < Slots.size())
+      Slots[ID].Gen = 0;
+  }
+
+  void clear() {
+    if (++Gen != 0)
+      return;
+    // the counter wrapped; stale entries could alias the new generation.
+    for (Slot &S : Slots)
+      S.Gen = 0;
+    Gen = 1;
+  }
+};
+
+} // end namespace zlang
+
+#endif // ZLANG_SYMBOLTABLE_H
@@ -0,0 +1,310 @@
+//===- TimeReport.h - Time spent in each phase of zlang ---------*- C++ -*-===//
+//
+// Contains the TimeReport, which records how long each phase of compilation
+// takes: lexing, parsing, codegen, bytecode lowering, every optimization pass,
+// object emission, linking and symbol lookup. Each timed region is kept as an
+// event naming the function, pass or symbol it covered, so the report can be
+// printed as per-phase totals broken down by name, written as JSON, or written
+// in the Chrome trace format for chrome://tracing and Perfetto. Events may be
+// recorded from any thread; lexing is only totalled, as it is timed per token.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef ZLANG_TIMEREPORT_H
+#define ZLANG_TIMEREPORT_H
+
+#include "llvm/ADT/Any.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace zlang {
+
+class TimeReport {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // Parsing includes the lexing it asks for, and a lookup includes compiling
+  // what it has to materialize on the calling thread. Nothing else overlaps.
+  enum Phase { Lex, Parse, Codegen, Lower, Opt, Emit, Link, Lookup, NumPhases };
+
+  static const char *getPhaseName(Phase P) {
+    static const char *const Names[NumPhases] = {
+        "lex", "parse", "codegen", "lower", "opt", "emit", "link", "lookup"};
+    return Names[P];
+  }
+
+  // Times the region from construction until stop() or destruction. Does
+  // nothing if the report is null, so it can stay in place when timing is off.
+  class Scope {
+  private:
+    TimeReport *R;
+    Phase P;
+    std::string Name;
+    Clock::time_point Start;
+
+  public:
+    Scope(TimeReport *R, Phase P, llvm::StringRef Name = "") : R(R), P(P) {
+      if (!R)
+        return;
+      this->Name = Name.str();
+      Start = Clock::now();
+    }
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+    ~Scope() { stop(); }
+
+    // Name the region once it is known, such as a function after parsing.
+    void setName(llvm::StringRef NewName) {
+      if (R)
+        Name = NewName.str();
+    }
+
+    void stop() {
+      if (!R)
+        return;
+      R->record(P, std::move(Name), "", Start, Clock::now());
+      R = nullptr;
+    }
+  };
+
+private:
+  struct Event {
+    Phase P;
+    std::string Name;
+    // What a pass ran on, if it was a function.
+    std::string Unit;
+    uint64_t Thread;
+    Clock::duration Start; // since Begin
+    Clock::duration Length;
+  };
+
+  struct Total {
+    Clock::duration Time{};
+    uint64_t Count = 0;
+  };
+
+  const Clock::time_point Begin = Clock::now();
+
+  std::mutex EventsMutex;
+  std::vector<Event> Events;
+
+  // Only added to by the thread lexing the source.
+  Total LexTotal;
+
+  // Pass managers and adaptors only run other passes.
+  static bool isWrapperPass(llvm::StringRef PassID) {
+    return llvm::isSpecialPass(PassID, {"PassManager", "PassAdaptor",
+                                        "AnalysisManagerProxy",
+                                        "ModuleInlinerWrapperPass",
+                                        "DevirtSCCRepeatedPass"});
+  }
+
+  // Start times of the passes running on this thread, innermost last.
+  static std::vector<Clock::time_point> &passStack() {
+    static thread_local std::vector<Clock::time_point> Stack;
+    return Stack;
+  }
+
+  void endPass(llvm::StringRef PassID, std::string Unit) {
+    auto &Stack = passStack();
+    if (Stack.empty())
+      return;
+    Clock::time_point Start = Stack.back();
+    Stack.pop_back();
+    record(Opt, PassID.str(), std::move(Unit), Start, Clock::now());
+  }
+
+  static double toMillis(Clock::duration D) {
+    return std::chrono::duration<double, std::milli>(D).count();
+  }
+
+  static int64_t toMicros(Clock::duration D) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(D).count();
+  }
+
+  // Totals for each phase and for each name within it, names by decreasing
+  // time.
+  struct Summary {
+    Total Phases[NumPhases];
+    std::vector<std::pair<std::string, Total>> ByName[NumPhases];
+  };
+
+  Summary summarize() {
+    Summary S;
+    S.Phases[Lex] = LexTotal;
+    llvm::StringMap<Total> Names[NumPhases];
+    {
+      std::lock_guard<std::mutex> Lock(EventsMutex);
+      for (const Event &E : Events) {
+        for (Total *T : {&S.Phases[E.P], &Names[E.P][E.Name]}) {
+          T->Time += E.Length;
+          ++T->Count;
+        }
+      }
+    }
+    for (unsigned P = 0; P != NumPhases; ++P) {
+      for (auto &N : Names[P])
+        S.ByName[P].emplace_back(N.getKey().str(), N.getValue());
+      llvm::sort(S.ByName[P], [](const auto &A, const auto &B) {
+        return A.second.Time > B.second.Time;
+      });
+    }
+    return S;
+  }
+
+public:
+  void record(Phase P, std::string Name, std::string Unit,
+              Clock::time_point Start, Clock::time_point End) {
+    Event E{P, std::move(Name), std::move(Unit), llvm::get_threadid(),
+            Start - Begin, End - Start};
+    std::lock_guard<std::mutex> Lock(EventsMutex);
+    Events.push_back(std::move(E));
+  }
+
+  void addLexTime(Clock::duration D) {
+    LexTotal.Time += D;
+    ++LexTotal.Count;
+  }
+
+  // Time every pass run by pass managers built with PIC.
+  void registerCallbacks(llvm::PassInstrumentationCallbacks &PIC) {
+    PIC.registerBeforeNonSkippedPassCallback([](llvm::StringRef PassID,
+                                                llvm::Any) {
+      if (!isWrapperPass(PassID))
+        passStack().push_back(Clock::now());
+    });
+    PIC.registerAfterPassCallback([this](llvm::StringRef PassID, llvm::Any IR,
+                                         const llvm::PreservedAnalyses &) {
+      if (isWrapperPass(PassID))
+        return;
+      std::string Unit;
+      if (llvm::any_isa<const llvm::Function *>(IR))
+        Unit = llvm::any_cast<const llvm::Function *>(IR)->getName().str();
+      endPass(PassID, std::move(Unit));
+    });
+    PIC.registerAfterPassInvalidatedCallback(
+        [this](llvm::StringRef PassID, const llvm::PreservedAnalyses &) {
+          if (!isWrapperPass(PassID))
+            endPass(PassID, "");
+        });
+  }
+
+  // Name a module by the first function it defines.
+  static std::string describe(const llvm::Module &M) {
+    unsigned N = 0;
+    std::string First;
+    for (const llvm::Function &F : M) {
+      if (F.isDeclaration() || F.hasAvailableExternallyLinkage())
+        continue;
+      if (!N++)
+        First = F.getName().str();
+    }
+    if (N > 1)
+      First += " (+" + std::to_string(N - 1) + " more)";
+    return First;
+  }
+
+  // Totals for each phase, then the names that took longest in each.
+  void printText(llvm::raw_ostream &OS, unsigned TopNames = 10) {
+    Summary S = summarize();
+    OS << "===" << std::string(73, '-') << "===\n"
+       << "                         zlang time report\n"
+       << "===" << std::string(73, '-') << "===\n";
+    OS << llvm::format("  Total: %.3f ms since the engine started\n\n",
+                       toMillis(Clock::now() - Begin));
+    OS << "   Time (ms)     Count  Phase\n";
+    for (unsigned P = 0; P != NumPhases; ++P)
+      if (S.Phases[P].Count)
+        OS << llvm::format("  %10.3f  %8llu  %s\n", toMillis(S.Phases[P].Time),
+                           (unsigned long long)S.Phases[P].Count,
+                           getPhaseName(Phase(P)));
+    OS << "  (parse includes lex; lookup includes what it compiles)\n";
+
+    for (unsigned P = 0; P != NumPhases; ++P) {
+      auto &Names = S.ByName[P];
+      if (Names.empty())
+        continue;
+      OS << "\n  " << getPhaseName(Phase(P));
+      if (Names.size() > TopNames)
+        OS << ", top " << TopNames << " of " << Names.size();
+      OS << ":\n";
+      for (unsigned i = 0, e = std::min<size_t>(Names.size(), TopNames);
+           i != e; ++i)
+        OS << llvm::format("  %10.3f  %8llu  ", toMillis(Names[i].second.Time),
+                           (unsigned long long)Names[i].second.Count)
+           << (Names[i].first.empty() ? "<unnamed>" : Names[i].first) << "\n";
+    }
+  }
+
+  // The same totals, with every name, as a JSON object.
+  void printJSON(llvm::raw_ostream &OS) {
+    Summary S = summarize();
+    llvm::json::OStream J(OS, 2);
+    J.object([&] {
+      J.attribute("total_ms", toMillis(Clock::now() - Begin));
+      J.attributeArray("phases", [&] {
+        for (unsigned P = 0; P != NumPhases; ++P) {
+          if (!S.Phases[P].Count)
+            continue;
+          J.object([&] {
+            J.attribute("phase", getPhaseName(Phase(P)));
+            J.attribute("ms", toMillis(S.Phases[P].Time));
+            J.attribute("count", int64_t(S.Phases[P].Count));
+            if (P == Lex)
+              return;
+            J.attributeArray("names", [&] {
+              for (auto &N : S.ByName[P])
+                J.object([&] {
+                  J.attribute("name", N.first);
+                  J.attribute("ms", toMillis(N.second.Time));
+                  J.attribute("count", int64_t(N.second.Count));
+                });
+            });
+          });
+        }
+      });
+    });
+    OS << "\n";
+  }
+
+  // Every event, as complete ("X") events in the Chrome trace format.
+  void printChromeTrace(llvm::raw_ostream &OS) {
+    std::lock_guard<std::mutex> Lock(EventsMutex);
+    llvm::json::OStream J(OS);
+    J.object([&] {
+      J.attributeArray("traceEvents", [&] {
+        for (const Event &E : Events)
+          J.object([&] {
+            J.attribute("name", E.Name);
+            J.attribute("cat", getPhaseName(E.P));
+            J.attribute("ph", "X");
+            J.attribute("ts", toMicros(E.Start));
+            J.attribute("dur", toMicros(E.Length));
+            J.attribute("pid", 1);
+            J.attribute("tid", int64_t(E.Thread));
+            if (!E.Unit.empty())
+              J.attributeObject("args",
+                                [&] { J.attribute("function", E.Unit); });
+          });
+      });
+      J.attribute("displayTimeUnit", "ms");
+    });
+    OS << "\n";
+  }
+};
+
+} // end namespace zlang
+
+#endif // ZLANG_TIMEREPORT_H